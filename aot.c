@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+/*
+    Ahead of time translator: turns a ROM into a C translation unit with one
+    labeled section per basic block. Usage: chip8c rom.ch8 out.c
+
+    The generated run_rom() follows the interpreter core contract from
+    decoder.h: it runs at most budget instructions, checked at block entries,
+    and returns how many it executed, or -1 on an invalid instruction. It
+    keeps the machine state in struct chip8 and only stores the PC before
+    calling a handler from cpu.c or leaving. Untranslated addresses are
+    interpreted one instruction at a time. Once translated code has been
+    written over it sets *stale and returns what it executed so far, and
+    the generated main() hands the machine to the interpreter for the rest
+    of the frame and from then on.
+*/
+
+#define START_ADDRESS 0x200
+#define MAX_ADDRESS (0x1000 - 1)
+
+struct program{
+    unsigned char memory[4096];
+    size_t size;
+    /* Addresses reached by the control flow analysis */
+    unsigned char reachable[4096];
+    /* Addresses that start a basic block and need a label */
+    unsigned char leader[4096];
+    /* Bytes that belong to a translated instruction */
+    unsigned char code[4096];
+};
+
+static unsigned short instruction_at(const struct program *p, unsigned short address){
+    return p->memory[address] << 8 | p->memory[address + 1];
+}
+
+static void add_target(struct program *p, unsigned short *worklist, int *pending, unsigned short address){
+    if(address >= MAX_ADDRESS){
+        return;
+    }
+    p->leader[address] = 1;
+    if(!p->reachable[address]){
+        p->reachable[address] = 1;
+        worklist[(*pending)++] = address;
+    }
+}
+
+/* Follows every statically known edge, starting from the entry point */
+static void build_cfg(struct program *p){
+    static unsigned short worklist[4096];
+    int pending = 0;
+
+    add_target(p, worklist, &pending, START_ADDRESS);
+    while(pending > 0){
+        unsigned short address = worklist[--pending];
+        struct decoded_instruction d;
+        predecode(&d, instruction_at(p, address));
+        p->code[address] = p->code[address + 1] = 1;
+
+        switch(d.op){
+            case OP_INVALID:
+            case OP_RET:
+            case OP_JMP_REL: {
+                /* Resolved at run time by the dispatcher */
+                break;
+            }
+            case OP_JMP: {
+                add_target(p, worklist, &pending, d.nnn);
+                break;
+            }
+            case OP_CALL: {
+                add_target(p, worklist, &pending, d.nnn);
+                add_target(p, worklist, &pending, address + 2);
+                break;
+            }
+            case OP_ISKIP_ON_EQUAL:
+            case OP_ISKIP_ON_NOT_EQUAL:
+            case OP_SKIP_ON_EQUAL:
+            case OP_SKIP_ON_NOT_EQUAL:
+            case OP_SKIP_PRESSED:
+            case OP_SKIP_NOT_PRESSED: {
+                add_target(p, worklist, &pending, address + 2);
+                add_target(p, worklist, &pending, address + 4);
+                break;
+            }
+            default: {
+                /* Falls through, without starting a new block */
+                if(address + 2 < MAX_ADDRESS && !p->reachable[address + 2]){
+                    p->reachable[address + 2] = 1;
+                    worklist[pending++] = address + 2;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/* Calls into cpu.c for the instructions that are not translated inline */
+static void emit_handler_call(FILE *out, const struct decoded_instruction *d){
+    switch(d->op){
+        case OP_CLS: fprintf(out, "    cls(chip);\n"); break;
+        case OP_ADD: fprintf(out, "    add(chip, %u, %u);\n", d->x, d->y); break;
+        case OP_SUB: fprintf(out, "    sub(chip, %u, %u);\n", d->x, d->y); break;
+        case OP_SHR: fprintf(out, "    shr(chip, %u);\n", d->x); break;
+        case OP_SUBN: fprintf(out, "    subn(chip, %u, %u);\n", d->x, d->y); break;
+        case OP_SHL: fprintf(out, "    shl(chip, %u);\n", d->x); break;
+        case OP_SET_RAND: fprintf(out, "    set_rand(chip, %u, 0x%02x);\n", d->x, d->kk); break;
+        case OP_DISPLAY_SPRITE: fprintf(out, "    display_sprite(chip, %u, %u, %u);\n", d->x, d->y, d->n); break;
+        case OP_SKIP_PRESSED: fprintf(out, "    skip_pressed(chip, %u);\n", d->x); break;
+        case OP_SKIP_NOT_PRESSED: fprintf(out, "    skip_not_pressed(chip, %u);\n", d->x); break;
+        case OP_LOAD_DELAY: fprintf(out, "    load_delay(chip, %u);\n", d->x); break;
+        case OP_WAIT_FOR_KEY: fprintf(out, "    wait_for_key(chip, %u);\n", d->x); break;
+        case OP_SET_DELAY: fprintf(out, "    set_delay(chip, %u);\n", d->x); break;
+        case OP_SET_SOUND: fprintf(out, "    set_sound(chip, %u);\n", d->x); break;
+        case OP_LOAD_LOCATION: fprintf(out, "    load_location(chip, %u);\n", d->x); break;
+        case OP_STORE_BCD: fprintf(out, "    store_bcd(chip, %u);\n", d->x); break;
+        case OP_STORE_REGISTERS: fprintf(out, "    store_registers(chip, %u);\n", d->x); break;
+        case OP_LOAD_REGISTERS: fprintf(out, "    load_registers(chip, %u);\n", d->x); break;
+    }
+}
+
+/* Targets past the last full instruction have no label, leave them to the interpreter */
+static void emit_goto(FILE *out, const char *indent, unsigned short target){
+    if(target < MAX_ADDRESS){
+        fprintf(out, "%sgoto L%03x;\n", indent, target);
+    }else{
+        fprintf(out, "%s{ chip->pc = 0x%03x; goto interpret; }\n", indent, target);
+    }
+}
+
+/* Fx07, 3x00, 1nnn back to the Fx07, the same idle loop predecode_at() looks for */
+static int is_delay_wait(const struct program *p, unsigned short address, const struct decoded_instruction *d){
+    return d->op == OP_LOAD_DELAY && address + 5 < MAX_ADDRESS &&
+            instruction_at(p, address + 2) == (0x3000 | d->x << 8) &&
+            instruction_at(p, address + 4) == (0x1000 | address);
+}
+
+static void emit_skip(FILE *out, unsigned short address, const char *condition){
+    fprintf(out, "    if(%s)\n", condition);
+    emit_goto(out, "        ", address + 4);
+    emit_goto(out, "    ", address + 2);
+}
+
+/*
+    Emits one instruction. Returns 1 if execution may continue at the next
+    address, 0 if the instruction always transfers control.
+*/
+static int emit_instruction(FILE *out, const struct program *p, unsigned short address,
+        const struct decoded_instruction *d){
+    char condition[64];
+
+    if(d->op == OP_INVALID){
+        fprintf(out, "    chip->pc = 0x%03x;\n    goto interpret;\n", address);
+        return 0;
+    }
+    fprintf(out, "    executed++;\n");
+
+    switch(d->op){
+        case OP_LOAD_DELAY: {
+            fprintf(out, "    chip->pc = 0x%03x;\n", address);
+            emit_handler_call(out, d);
+            if(is_delay_wait(p, address, d)){
+                /* Idle until the next timer tick, end the frame early */
+                fprintf(out, "    if(V[%u] != 0){\n        chip->pc = 0x%03x;\n        return executed;\n    }\n",
+                        d->x, address);
+            }
+            return 1;
+        }
+        case OP_RET: {
+            fprintf(out, "    ret(chip);\n    goto dispatch;\n");
+            return 0;
+        }
+        case OP_JMP: {
+            if(d->nnn == address){
+                /* Halted, end the frame early */
+                fprintf(out, "    chip->pc = 0x%03x;\n    return executed;\n", address);
+                return 0;
+            }
+            emit_goto(out, "    ", d->nnn);
+            return 0;
+        }
+        case OP_CALL: {
+            fprintf(out, "    chip->pc = 0x%03x;\n    call(chip, 0x%03x);\n", address, d->nnn);
+            emit_goto(out, "    ", d->nnn);
+            return 0;
+        }
+        case OP_JMP_REL: {
+            fprintf(out, "    jmp_rel(chip, 0x%03x);\n    goto dispatch;\n", d->nnn);
+            return 0;
+        }
+        case OP_ISKIP_ON_EQUAL: {
+            snprintf(condition, sizeof(condition), "V[%u] == 0x%02x", d->x, d->kk);
+            emit_skip(out, address, condition);
+            return 0;
+        }
+        case OP_ISKIP_ON_NOT_EQUAL: {
+            snprintf(condition, sizeof(condition), "V[%u] != 0x%02x", d->x, d->kk);
+            emit_skip(out, address, condition);
+            return 0;
+        }
+        case OP_SKIP_ON_EQUAL: {
+            snprintf(condition, sizeof(condition), "V[%u] == V[%u]", d->x, d->y);
+            emit_skip(out, address, condition);
+            return 0;
+        }
+        case OP_SKIP_ON_NOT_EQUAL: {
+            snprintf(condition, sizeof(condition), "V[%u] != V[%u]", d->x, d->y);
+            emit_skip(out, address, condition);
+            return 0;
+        }
+        case OP_SKIP_PRESSED:
+        case OP_SKIP_NOT_PRESSED: {
+            fprintf(out, "    chip->pc = 0x%03x;\n", address);
+            emit_handler_call(out, d);
+            fprintf(out, "    goto dispatch;\n");
+            return 0;
+        }
+        case OP_WAIT_FOR_KEY: {
+            /* Stopped until run_frame() sees a key press */
+            fprintf(out, "    chip->pc = 0x%03x;\n", address);
+            emit_handler_call(out, d);
+            fprintf(out, "    return executed;\n");
+            return 0;
+        }
+        case OP_ILOAD: fprintf(out, "    V[%u] = 0x%02x;\n", d->x, d->kk); return 1;
+        case OP_IADD: fprintf(out, "    V[%u] += 0x%02x;\n", d->x, d->kk); return 1;
+        case OP_ASSIGN: fprintf(out, "    V[%u] = V[%u];\n", d->x, d->y); return 1;
+        case OP_OR: fprintf(out, "    V[%u] |= V[%u];\n", d->x, d->y); return 1;
+        case OP_AND: fprintf(out, "    V[%u] &= V[%u];\n", d->x, d->y); return 1;
+        case OP_XOR: fprintf(out, "    V[%u] ^= V[%u];\n", d->x, d->y); return 1;
+        case OP_SET_INDEX: fprintf(out, "    chip->index_register = 0x%03x;\n", d->nnn); return 1;
+        case OP_ADD_TO_INDEX: fprintf(out, "    chip->index_register += V[%u];\n", d->x); return 1;
+        case OP_STORE_BCD:
+        case OP_STORE_REGISTERS: {
+            fprintf(out, "    chip->pc = 0x%03x;\n", address);
+            emit_handler_call(out, d);
+            fprintf(out, "    if(code_written(chip, chip->index_register, %u)){\n        *stale = 1;\n        return executed;\n    }\n",
+                    d->op == OP_STORE_BCD ? 3 : d->x + 1);
+            return 1;
+        }
+        default: {
+            fprintf(out, "    chip->pc = 0x%03x;\n", address);
+            emit_handler_call(out, d);
+            return 1;
+        }
+    }
+}
+
+static void emit_program(FILE *out, const struct program *p, const char *rom_path){
+    fprintf(out, "/* Generated by chip8c from %s, do not edit */\n", rom_path);
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n");
+    fprintf(out, "#include \"cpu.h\"\n#include \"decoder.h\"\n#include \"scheduler.h\"\n\n");
+    fprintf(out, "#define ROM_START 0x%03x\n#define ROM_SIZE %zu\n\n", START_ADDRESS, p->size);
+
+    /* Translated code may lie outside the ROM, so the whole address space is kept */
+    fprintf(out, "/* Memory as the machine starts out, fonts and ROM */\nstatic const unsigned char memory_image[4096] = {");
+    for(int i = 0; i < 4096; i++){
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", p->memory[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "/* Bytes of translated instructions */\nstatic const unsigned char code_map[4096] = {");
+    for(int i = 0; i < 4096; i++){
+        fprintf(out, "%s%u,", i % 32 == 0 ? "\n    " : "", p->code[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out,
+        "/* Whether a store changed any of the bytes that were translated */\n"
+        "static int code_written(const struct chip8 *chip, unsigned short from, unsigned short length){\n"
+        "    for(unsigned short i = 0; i < length; i++){\n"
+        "        unsigned short address = (from + i) & 0xfff;\n"
+        "        if(code_map[address] && chip->memory[address] != memory_image[address]){\n"
+        "            return 1;\n"
+        "        }\n"
+        "    }\n"
+        "    return 0;\n"
+        "}\n\n");
+
+    fprintf(out, "long run_rom(struct chip8 *chip, long budget, int *stale){\n");
+    fprintf(out, "    unsigned char *V = chip->registers;\n    long executed = 0;\n    (void)V;\n    (void)code_written;\n    (void)stale;\n\n");
+    fprintf(out, "dispatch:\n    if(executed >= budget){\n        return executed;\n    }\n");
+    fprintf(out, "    switch(chip->pc){\n");
+    for(int a = 0; a < 4096; a++){
+        if(p->leader[a]){
+            fprintf(out, "        case 0x%03x: goto L%03x;\n", a, a);
+        }
+    }
+    fprintf(out, "        default: goto interpret;\n    }\n\n");
+    fprintf(out,
+        "interpret:\n"
+        "    /* Untranslated address */\n"
+        "    if(chip->pc >= 0x1000 - 1 || execute(chip, fetch(chip)) < 0){\n"
+        "        return -1;\n"
+        "    }\n"
+        "    executed++;\n"
+        "    goto dispatch;\n\n");
+
+    int next_emitted = -1;
+    for(int a = 0; a < 4096; a++){
+        if(!p->reachable[a]){
+            continue;
+        }
+        /* Overlapping instruction streams do not fall into each other */
+        if(next_emitted >= 0 && next_emitted != a){
+            fprintf(out, "    goto L%03x;\n", next_emitted);
+        }
+        if(p->leader[a]){
+            fprintf(out, "L%03x:\n", a);
+            fprintf(out, "    if(executed >= budget){\n        chip->pc = 0x%03x;\n        return executed;\n    }\n", a);
+        }else if(next_emitted != a){
+            fprintf(out, "L%03x:\n", a);
+        }
+        struct decoded_instruction d;
+        predecode(&d, instruction_at(p, a));
+        next_emitted = emit_instruction(out, p, a, &d) ? a + 2 : -1;
+    }
+    if(next_emitted >= 0){
+        fprintf(out, "    chip->pc = 0x%03x;\n    goto interpret;\n", next_emitted);
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out,
+        "#ifndef CHIP8_AOT_NO_MAIN\n"
+        "/* Usage: rom.aot [instructions per frame], paced to 60Hz like the emulator */\n"
+        "int main(int argc, char **argv){\n"
+        "    struct chip8 *chip = new_chip8();\n"
+        "    memcpy(chip->memory + ROM_START, memory_image + ROM_START, ROM_SIZE);\n"
+        "    chip->pc = ROM_START;\n"
+        "    if(argc > 1){\n"
+        "        chip->instructions_per_frame = strtoul(argv[1], NULL, 0);\n"
+        "    }\n"
+        "    int translated = 1;\n"
+        "    struct scheduler scheduler;\n"
+        "    start_scheduler(&scheduler);\n"
+        "    while(1){\n"
+        "        long executed = 0;\n"
+        "        poll_keys(chip);\n"
+        "        if(!chip->waiting_for_key && translated){\n"
+        "            int stale = 0;\n"
+        "            executed = run_rom(chip, chip->instructions_per_frame, &stale);\n"
+        "            /* Self modifying code, the translation is stale from here on */\n"
+        "            translated = !stale;\n"
+        "        }\n"
+        "        if(executed >= 0 && !chip->waiting_for_key && !translated){\n"
+        "            /* What is left of the frame the translation went stale in */\n"
+        "            long interpreted = decode(chip, chip->instructions_per_frame - executed);\n"
+        "            executed = interpreted < 0 ? interpreted : executed + interpreted;\n"
+        "        }\n"
+        "        if(executed < 0){\n"
+        "            perror(\"Invalid instruction\\n\");\n"
+        "            return 1;\n"
+        "        }\n"
+        "        tick_timers(chip);\n"
+        "        /* Sleeps until the next frame, or until a key press while Fx0A waits */\n"
+        "        wait_for_frame(&scheduler, chip);\n"
+        "    }\n"
+        "}\n"
+        "#endif\n");
+}
+
+int main(int argc, char **argv){
+    if(argc != 3){
+        fprintf(stderr, "Usage: %s rom.ch8 out.c\n", argv[0]);
+        return 1;
+    }
+
+    static struct program program;
+    FILE *rom = fopen(argv[1], "rb");
+    if(rom == NULL){
+        perror("Error opening the ROM");
+        return 1;
+    }
+    /* The fonts as well, the analysis may follow a jump into them */
+    static struct chip8 machine;
+    init_chip8(&machine);
+    memcpy(program.memory, machine.memory, sizeof(program.memory));
+    release_chip8(&machine);
+    program.size = fread(program.memory + START_ADDRESS, 1, sizeof(program.memory) - START_ADDRESS, rom);
+    fclose(rom);
+
+    build_cfg(&program);
+
+    FILE *out = fopen(argv[2], "w");
+    if(out == NULL){
+        perror("Error opening the output file");
+        return 1;
+    }
+    emit_program(out, &program, argv[1]);
+    fclose(out);
+    return 0;
+}
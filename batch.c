@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "decoder.h"
+
+/* Lanes are padded to this many, the width of an AVX2 register in bytes */
+#define LANE_ALIGN 32
+
+/* Builds the x86-64 kernels twice, picking the AVX2 one at load time when the CPU has it */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define LANE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_KERNEL
+#endif
+
+/* Loop over every lane; the body must only change lanes where group[l] is 0xff */
+#define EACH_LANE for(size_t l = 0; l < n; l++)
+
+/* Picks b where the byte mask m is 0xff and a where it is 0 */
+#define BLEND(a, b, m) ((m) ? (b) : (a))
+
+static void *carve(unsigned char **cursor, size_t size){
+    void *field = *cursor;
+    *cursor += (size + 63) & ~(size_t)63;
+    return field;
+}
+
+/* Lays out every field in one allocation, or only measures it when base is NULL */
+static size_t layout(struct chip8_batch *b, unsigned char *base){
+    unsigned char *cursor = base;
+    size_t n = b->stride;
+
+    b->registers = carve(&cursor, 16 * n);
+    b->memory = carve(&cursor, 4096 * n);
+    b->index_register = carve(&cursor, n * sizeof(unsigned short));
+    b->pc = carve(&cursor, n * sizeof(unsigned short));
+    b->stack = carve(&cursor, 16 * n * sizeof(unsigned short));
+    b->sp = carve(&cursor, n);
+    b->delay_timer = carve(&cursor, n);
+    b->sound_timer = carve(&cursor, n);
+    b->keys = carve(&cursor, 16 * n);
+    b->waiting_for_key = carve(&cursor, n);
+    b->key_register = carve(&cursor, n);
+    b->held_keys = carve(&cursor, n * sizeof(unsigned short));
+    b->display_memory = carve(&cursor, DISPLAY_HEIGTH * n * sizeof(uint64_t));
+    b->dirty_rows = carve(&cursor, n * sizeof(uint32_t));
+    b->rng_state = carve(&cursor, n * sizeof(unsigned int));
+    b->status = carve(&cursor, n);
+    b->runnable = carve(&cursor, n);
+    b->group = carve(&cursor, n);
+    b->executed = carve(&cursor, n * sizeof(uint32_t));
+    return cursor - base;
+}
+
+/* Creates lanes machines, each one a copy of init */
+struct chip8_batch *new_chip8_batch(size_t lanes, const struct chip8 *init){
+    struct chip8_batch *b = calloc(1, sizeof(struct chip8_batch));
+    if(b == NULL){
+        perror("Batch allocation failed");
+        return NULL;
+    }
+    b->lanes = lanes;
+    b->stride = (lanes + LANE_ALIGN - 1) & ~(size_t)(LANE_ALIGN - 1);
+    b->instructions_per_frame = init->instructions_per_frame;
+
+    size_t size = layout(b, NULL);
+    b->allocation = aligned_alloc(64, size);
+    if(b->allocation == NULL){
+        perror("Batch allocation failed");
+        free(b);
+        return NULL;
+    }
+    memset(b->allocation, 0, size);
+    layout(b, b->allocation);
+
+    for(size_t l = 0; l < lanes; l++){
+        batch_set_lane(b, l, init);
+    }
+    /* Padding lanes never run */
+    memset(b->status + lanes, LANE_FAULTED, b->stride - lanes);
+    return b;
+}
+
+void free_chip8_batch(struct chip8_batch *b){
+    free(b->allocation);
+    free(b);
+}
+
+/* Lane l gets the random sequence seed_chip8() gives for seed + l */
+void seed_chip8_batch(struct chip8_batch *b, unsigned int seed){
+    for(size_t l = 0; l < b->lanes; l++){
+        b->rng_state[l] = rng_state_for_seed(seed + l);
+    }
+}
+
+void batch_set_lane(struct chip8_batch *b, size_t l, const struct chip8 *chip){
+    size_t n = b->stride;
+
+    b->held_keys[l] = 0;
+    for(int i = 0; i < 16; i++){
+        b->registers[i * n + l] = chip->registers[i];
+        b->stack[i * n + l] = chip->stack[i];
+        b->keys[i * n + l] = chip->keys[i];
+        b->held_keys[l] |= (chip->keys[i] != 0) << i;
+    }
+    for(size_t a = 0; a < 4096; a++){
+        b->memory[a * n + l] = chip->memory[a];
+    }
+    for(int r = 0; r < DISPLAY_HEIGTH; r++){
+        b->display_memory[r * n + l] = chip->display_memory[r];
+    }
+    b->index_register[l] = chip->index_register;
+    b->pc[l] = chip->pc;
+    b->sp[l] = chip->sp;
+    b->delay_timer[l] = chip->delay_timer;
+    b->sound_timer[l] = chip->sound_timer;
+    b->waiting_for_key[l] = chip->waiting_for_key;
+    b->key_register[l] = chip->key_register;
+    b->dirty_rows[l] = chip->dirty_rows;
+    b->rng_state[l] = chip->rng_state;
+    b->status[l] = LANE_RUNNING;
+}
+
+/* Copies one lane out into a machine, whose decode cache is dropped */
+void batch_get_lane(const struct chip8_batch *b, size_t l, struct chip8 *chip){
+    size_t n = b->stride;
+
+    for(int i = 0; i < 16; i++){
+        chip->registers[i] = b->registers[i * n + l];
+        chip->stack[i] = b->stack[i * n + l];
+        chip->keys[i] = b->keys[i * n + l];
+    }
+    for(size_t a = 0; a < 4096; a++){
+        chip->memory[a] = b->memory[a * n + l];
+    }
+    for(int r = 0; r < DISPLAY_HEIGTH; r++){
+        chip->display_memory[r] = b->display_memory[r * n + l];
+    }
+    chip->index_register = b->index_register[l];
+    chip->pc = b->pc[l];
+    chip->sp = b->sp[l];
+    chip->delay_timer = b->delay_timer[l];
+    chip->sound_timer = b->sound_timer[l];
+    chip->waiting_for_key = b->waiting_for_key[l];
+    chip->key_register = b->key_register[l];
+    chip->dirty_rows |= b->dirty_rows[l];
+    chip->rng_state = b->rng_state[l];
+    invalidate_decode_cache(chip);
+}
+
+static unsigned short lane_instruction_at(const struct chip8_batch *b, size_t l, unsigned short address){
+    if(address >= 0x1000 - 1){
+        return 0;
+    }
+    return b->memory[address * b->stride + l] << 8 | b->memory[(address + 1) * b->stride + l];
+}
+
+/* Drops lanes from the group whose memory at [address, address + length) differs from the leader's */
+LANE_KERNEL static void match_memory(struct chip8_batch *b, size_t leader, unsigned short address, int length){
+    size_t n = b->stride;
+    unsigned char *group = b->group;
+
+    for(int i = 0; i < length; i++){
+        const unsigned char *byte = b->memory + (size_t)(address + i) * n;
+        unsigned char expected = byte[leader];
+        EACH_LANE {
+            group[l] &= byte[l] == expected ? 0xff : 0;
+        }
+    }
+}
+
+/*
+    Picks the next group: the runnable lanes on the lowest PC whose
+    instruction matches the first such lane. Running the lowest PC first lets
+    lanes that split on a skip or a branch meet again further on. Returns 0
+    when no lane is runnable.
+*/
+LANE_KERNEL static int select_group(struct chip8_batch *b, struct decoded_instruction *d){
+    size_t n = b->stride;
+    const unsigned short *pc = b->pc;
+    const unsigned char *runnable = b->runnable;
+    unsigned char *group = b->group;
+    unsigned short lowest = 0xffff;
+    unsigned char any = 0;
+
+    /* Kept free of branches so that both reductions vectorize */
+    EACH_LANE {
+        unsigned short candidate = pc[l] | (unsigned short)((runnable[l] ^ 0xff) * 0x101);
+        lowest = candidate < lowest ? candidate : lowest;
+        any |= runnable[l];
+    }
+    if(!any){
+        return 0;
+    }
+    if(lowest >= 0x1000 - 1){
+        /* Every runnable lane is past the last full instruction, they fault without executing */
+        unsigned char *status = b->status;
+        EACH_LANE {
+            status[l] = BLEND(status[l], LANE_FAULTED, runnable[l]);
+        }
+        memset(b->runnable, 0, n);
+        memset(group, 0, n);
+        predecode(d, 0);
+        return 1;
+    }
+
+    size_t leader = 0;
+    while(!(runnable[leader] && pc[leader] == lowest)){
+        leader++;
+    }
+    EACH_LANE {
+        group[l] = runnable[l] & (pc[l] == lowest ? 0xff : 0);
+    }
+    match_memory(b, leader, lowest, 2);
+
+    predecode(d, lane_instruction_at(b, leader, lowest));
+    if(!(lowest & 1) && detect_idle_loop(d, lowest, lane_instruction_at(b, leader, lowest + 2),
+            lane_instruction_at(b, leader, lowest + 4)) && d->op == OP_WAIT_DELAY){
+        /* The loop was recognized from the two instructions after it as well */
+        match_memory(b, leader, lowest + 2, 4);
+    }
+    return 1;
+}
+
+/* Runs one instruction on every lane of the group */
+LANE_KERNEL static void execute_group(struct chip8_batch *b, const struct decoded_instruction *d){
+    size_t n = b->stride;
+    const unsigned char *group = b->group;
+    unsigned char *runnable = b->runnable;
+    unsigned short *pc = b->pc;
+    unsigned short *index_register = b->index_register;
+    unsigned char *delay_timer = b->delay_timer;
+    unsigned char *sound_timer = b->sound_timer;
+    unsigned char *status = b->status;
+    unsigned char *vx = b->registers + d->x * n;
+    unsigned char *vy = b->registers + d->y * n;
+    unsigned char *vf = b->registers + 0xf * n;
+    unsigned char kk = d->kk;
+    unsigned short nnn = d->nnn;
+
+    switch(d->op){
+        case OP_CLS: {
+            uint32_t *dirty_rows = b->dirty_rows;
+            for(int r = 0; r < DISPLAY_HEIGTH; r++){
+                uint64_t *row = b->display_memory + r * n;
+                EACH_LANE {
+                    row[l] &= (uint64_t)(unsigned char)~group[l] * 0x0101010101010101;
+                }
+            }
+            EACH_LANE {
+                dirty_rows[l] |= (uint32_t)group[l] * 0x01010101;
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_RET: {
+            EACH_LANE {
+                if(!group[l]){
+                    continue;
+                }
+                if(b->sp[l] == 0){
+                    pc[l] = 0;
+                }else{
+                    b->sp[l]--;
+                    pc[l] = b->stack[b->sp[l] * n + l];
+                }
+            }
+            break;
+        }
+        case OP_JMP: {
+            EACH_LANE {
+                pc[l] = BLEND(pc[l], nnn, group[l]);
+            }
+            break;
+        }
+        case OP_CALL: {
+            EACH_LANE {
+                if(!group[l]){
+                    continue;
+                }
+                if(b->sp[l] < 16){
+                    b->stack[b->sp[l] * n + l] = pc[l] + 2;
+                    b->sp[l]++;
+                }
+                pc[l] = nnn;
+            }
+            break;
+        }
+        case OP_ISKIP_ON_EQUAL: {
+            EACH_LANE {
+                pc[l] += group[l] & (vx[l] == kk ? 4 : 2);
+            }
+            break;
+        }
+        case OP_ISKIP_ON_NOT_EQUAL: {
+            EACH_LANE {
+                pc[l] += group[l] & (vx[l] != kk ? 4 : 2);
+            }
+            break;
+        }
+        case OP_SKIP_ON_EQUAL: {
+            EACH_LANE {
+                pc[l] += group[l] & (vx[l] == vy[l] ? 4 : 2);
+            }
+            break;
+        }
+        case OP_SKIP_ON_NOT_EQUAL: {
+            EACH_LANE {
+                pc[l] += group[l] & (vx[l] != vy[l] ? 4 : 2);
+            }
+            break;
+        }
+        case OP_ILOAD: {
+            EACH_LANE {
+                vx[l] = BLEND(vx[l], kk, group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_IADD: {
+            EACH_LANE {
+                vx[l] += kk & group[l];
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_ASSIGN: {
+            EACH_LANE {
+                vx[l] = BLEND(vx[l], vy[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_OR: {
+            EACH_LANE {
+                vx[l] |= vy[l] & group[l];
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_AND: {
+            EACH_LANE {
+                vx[l] &= vy[l] | (unsigned char)~group[l];
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_XOR: {
+            EACH_LANE {
+                vx[l] ^= vy[l] & group[l];
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        /* The flag updates below follow cpu.c statement by statement, VF may alias Vx or Vy */
+        case OP_ADD: {
+            EACH_LANE {
+                unsigned int result = vx[l] + vy[l];
+                vf[l] = BLEND(vf[l], result > 255, group[l]);
+                vx[l] = BLEND(vx[l], (unsigned char)result, group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SUB: {
+            EACH_LANE {
+                vx[l] = BLEND(vx[l], (unsigned char)(vx[l] - vy[l]), group[l]);
+                vf[l] = BLEND(vf[l], vx[l] >= vy[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SHR: {
+            EACH_LANE {
+                vf[l] = BLEND(vf[l], vx[l] & 1, group[l]);
+                vx[l] = BLEND(vx[l], vx[l] >> 1, group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SUBN: {
+            EACH_LANE {
+                vx[l] = BLEND(vx[l], (unsigned char)(vy[l] - vx[l]), group[l]);
+                vf[l] = BLEND(vf[l], vy[l] >= vx[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SHL: {
+            EACH_LANE {
+                vf[l] = BLEND(vf[l], vx[l] & 0x80, group[l]);
+                vx[l] = BLEND(vx[l], (unsigned char)(vx[l] << 1), group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SET_INDEX: {
+            EACH_LANE {
+                index_register[l] = BLEND(index_register[l], nnn, group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_JMP_REL: {
+            const unsigned char *v0 = b->registers;
+            EACH_LANE {
+                pc[l] = BLEND(pc[l], v0[l] + nnn, group[l]);
+            }
+            break;
+        }
+        case OP_SET_RAND: {
+            unsigned int *rng_state = b->rng_state;
+            EACH_LANE {
+                unsigned int r = rng_state[l];
+                r ^= r << 13;
+                r ^= r >> 17;
+                r ^= r << 5;
+                rng_state[l] = BLEND(rng_state[l], r, group[l]);
+                vx[l] = BLEND(vx[l], (r >> 24) & kk, group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_DISPLAY_SPRITE: {
+            /* Every lane reads its own sprite and draws at its own position */
+            EACH_LANE {
+                if(!group[l]){
+                    continue;
+                }
+                unsigned char x_pos = vx[l] % DISPLAY_WIDTH;
+                unsigned char y_pos = vy[l] % DISPLAY_HEIGTH;
+                uint64_t erased = 0;
+                for(int i = 0; i < d->n; i++){
+                    uint64_t sprite_row = (uint64_t)b->memory[((index_register[l] + i) & 0xfff) * n + l] << 56;
+                    sprite_row = (sprite_row >> x_pos) | (sprite_row << ((DISPLAY_WIDTH - x_pos) & 63));
+
+                    unsigned char row_index = (y_pos + i) % DISPLAY_HEIGTH;
+                    uint64_t *row = &b->display_memory[row_index * n + l];
+                    erased |= *row & sprite_row;
+                    *row ^= sprite_row;
+                    if(sprite_row){
+                        b->dirty_rows[l] |= 1u << row_index;
+                    }
+                }
+                vf[l] = erased != 0;
+                pc[l] += 2;
+            }
+            break;
+        }
+        case OP_SKIP_PRESSED: {
+            EACH_LANE {
+                unsigned char pressed = b->keys[(vx[l] & 0xf) * n + l];
+                pc[l] += group[l] & (pressed == 1 ? 4 : 2);
+            }
+            break;
+        }
+        case OP_SKIP_NOT_PRESSED: {
+            EACH_LANE {
+                unsigned char pressed = b->keys[(vx[l] & 0xf) * n + l];
+                pc[l] += group[l] & (pressed == 0 ? 4 : 2);
+            }
+            break;
+        }
+        case OP_LOAD_DELAY: {
+            EACH_LANE {
+                vx[l] = BLEND(vx[l], delay_timer[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_WAIT_DELAY: {
+            /* Same as op_wait_delay(): lanes with a running timer stay on the loop until the next frame */
+            EACH_LANE {
+                unsigned char waiting = delay_timer[l] != 0 ? 0xff : 0;
+                vx[l] = BLEND(vx[l], delay_timer[l], group[l]);
+                pc[l] += group[l] & ~waiting & 2;
+                runnable[l] &= ~(group[l] & waiting);
+            }
+            break;
+        }
+        case OP_JMP_SELF: {
+            EACH_LANE {
+                runnable[l] &= ~group[l];
+            }
+            break;
+        }
+        case OP_WAIT_FOR_KEY: {
+            EACH_LANE {
+                b->waiting_for_key[l] = BLEND(b->waiting_for_key[l], 1, group[l]);
+                b->key_register[l] = BLEND(b->key_register[l], d->x, group[l]);
+                runnable[l] &= ~group[l];
+            }
+            break;
+        }
+        case OP_SET_DELAY: {
+            EACH_LANE {
+                delay_timer[l] = BLEND(delay_timer[l], vx[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_SET_SOUND: {
+            EACH_LANE {
+                sound_timer[l] = BLEND(sound_timer[l], vx[l], group[l]);
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_ADD_TO_INDEX: {
+            EACH_LANE {
+                index_register[l] += vx[l] & group[l];
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_LOAD_LOCATION: {
+            EACH_LANE {
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_STORE_BCD: {
+            EACH_LANE {
+                if(!group[l]){
+                    continue;
+                }
+                unsigned char value = vx[l];
+                unsigned char digits[3] = {value / 100, value / 10 % 10, value % 10};
+                for(int i = 0; i < 3; i++){
+                    b->memory[((index_register[l] + i) & 0xfff) * n + l] = digits[i];
+                }
+                pc[l] += 2;
+            }
+            break;
+        }
+        case OP_STORE_REGISTERS: {
+            for(int i = 0; i <= d->x; i++){
+                const unsigned char *vi = b->registers + i * n;
+                EACH_LANE {
+                    if(group[l]){
+                        b->memory[((index_register[l] + i) & 0xfff) * n + l] = vi[l];
+                    }
+                }
+            }
+            EACH_LANE {
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        case OP_LOAD_REGISTERS: {
+            for(int i = 0; i <= d->x; i++){
+                unsigned char *vi = b->registers + i * n;
+                EACH_LANE {
+                    if(group[l]){
+                        vi[l] = b->memory[((index_register[l] + i) & 0xfff) * n + l];
+                    }
+                }
+            }
+            EACH_LANE {
+                pc[l] += group[l] & 2;
+            }
+            break;
+        }
+        default: {
+            EACH_LANE {
+                status[l] = BLEND(status[l], LANE_FAULTED, group[l]);
+                runnable[l] &= ~group[l];
+            }
+            break;
+        }
+    }
+}
+
+/*
+    Runs every lane for at most budget instructions, like decode() does for
+    one machine: a lane stops early on Fx0A, an idle loop or a fault. Lanes
+    are run in groups that share a PC, so the cost of an instruction is one
+    pass over the lanes no matter how many of them execute it. Returns the
+    number of instructions executed across all lanes.
+*/
+LANE_KERNEL long batch_run(struct chip8_batch *b, long budget){
+    size_t n = b->stride;
+    unsigned char *runnable = b->runnable;
+    unsigned char *group = b->group;
+    uint32_t *executed = b->executed;
+    struct decoded_instruction d;
+    long total = 0;
+
+    const unsigned char *status = b->status;
+    const unsigned char *waiting_for_key = b->waiting_for_key;
+    EACH_LANE {
+        runnable[l] = status[l] == LANE_RUNNING && !waiting_for_key[l] ? 0xff : 0;
+        executed[l] = 0;
+    }
+    if(budget <= 0){
+        return 0;
+    }
+
+    /* Per lane counts are capped, a lane can only get that far in one call anyway */
+    uint32_t limit = budget < UINT32_MAX ? budget : UINT32_MAX;
+    while(select_group(b, &d)){
+        uint32_t count = 0;
+        EACH_LANE {
+            executed[l] += group[l] & 1;
+            count += group[l] & 1;
+            runnable[l] &= executed[l] < limit ? 0xff : 0;
+        }
+        total += count;
+        execute_group(b, &d);
+    }
+    return total;
+}
+
+/*
+    One 60Hz frame for every lane, like run_frame(), of the template
+    machine's instructions_per_frame. Keys are read from the keys array as
+    they are at the start of the frame, and a key down now that was up at
+    the previous frame is a press, as poll_keys() sees one: a lane waiting
+    on Fx0A takes the lowest key pressed, holding a key down does not
+    answer a second Fx0A. Returns the instructions executed.
+*/
+long batch_run_frame(struct chip8_batch *b){
+    size_t n = b->stride;
+
+    for(size_t l = 0; l < b->lanes; l++){
+        unsigned short held = 0;
+        for(int key = 0; key < 16; key++){
+            held |= (b->keys[key * n + l] != 0) << key;
+        }
+        unsigned short presses = held & ~b->held_keys[l];
+        b->held_keys[l] = held;
+        if(b->waiting_for_key[l] && presses != 0){
+            b->registers[b->key_register[l] * n + l] = __builtin_ctz(presses);
+            b->waiting_for_key[l] = 0;
+            b->pc[l] += 2;
+        }
+    }
+
+    long executed = batch_run(b, b->instructions_per_frame);
+
+    const unsigned char *status = b->status;
+    unsigned char *delay_timer = b->delay_timer;
+    unsigned char *sound_timer = b->sound_timer;
+    EACH_LANE {
+        unsigned char live = status[l] == LANE_RUNNING;
+        delay_timer[l] -= live & (delay_timer[l] != 0);
+        sound_timer[l] -= live & (sound_timer[l] != 0);
+    }
+    return executed;
+}
@@ -0,0 +1,61 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Lane state, besides the machine state itself */
+enum lane_status{
+    LANE_RUNNING,
+    /* Hit an invalid instruction or address, the lane never runs again */
+    LANE_FAULTED
+};
+
+/*
+    Many machines stored as a structure of arrays: element i of a field for
+    lane l is at field[i * stride + l], so the same register of every lane
+    is contiguous. Lanes that sit on the same instruction execute it
+    together, as one loop over the lanes that the compiler turns into SIMD.
+    The fields mirror struct chip8 and may be read or written between runs.
+*/
+struct chip8_batch{
+    size_t lanes;
+    /* lanes rounded up to a whole number of vectors */
+    size_t stride;
+    unsigned char *registers;       /* [16][stride] */
+    unsigned char *memory;          /* [4096][stride] */
+    unsigned short *index_register;
+    unsigned short *pc;
+    unsigned short *stack;          /* [16][stride] */
+    unsigned char *sp;
+    unsigned char *delay_timer;
+    unsigned char *sound_timer;
+    unsigned char *keys;            /* [16][stride] */
+    unsigned char *waiting_for_key;
+    unsigned char *key_register;
+    /* Keys down at the last batch_run_frame(), one bit per key */
+    unsigned short *held_keys;
+    uint64_t *display_memory;       /* [DISPLAY_HEIGTH][stride] */
+    uint32_t *dirty_rows;
+    unsigned int *rng_state;
+    unsigned char *status;
+    /* Instructions batch_run_frame() runs per lane, from the template machine */
+    unsigned short instructions_per_frame;
+
+    /* Scratch space for batch_run() */
+    unsigned char *runnable;
+    unsigned char *group;
+    uint32_t *executed;
+    void *allocation;
+};
+
+struct chip8_batch *new_chip8_batch(size_t, const struct chip8 *);
+void free_chip8_batch(struct chip8_batch *);
+void seed_chip8_batch(struct chip8_batch *, unsigned int);
+void batch_set_lane(struct chip8_batch *, size_t, const struct chip8 *);
+void batch_get_lane(const struct chip8_batch *, size_t, struct chip8 *);
+long batch_run(struct chip8_batch *, long);
+long batch_run_frame(struct chip8_batch *);
+
+#endif
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "jit.h"
+#include "quirks.h"
+#include "batch.h"
+#include "vec_env.h"
+
+/*
+    chip8-bench: measures the handlers, the cores on synthetic ROMs and
+    the cores on real ROMs, and prints the results as one JSON object.
+
+    Usage: chip8-bench [-n instructions] [-r repeats] [rom...]
+    -n instructions per core run, 20000000 by default
+    -r how many times every measurement is taken, the median is reported
+
+    Next to the cores, every ROM also runs on the batch engine, BATCH_LANES
+    copies of it at once, and as BATCH_LANES environments of a
+    chip8_vec_env stepped one frame at a time. The batch reports the
+    instructions of all its lanes together.
+
+    Everything is seeded and sized the same on every run, so two versions
+    can be compared on one machine. make bench runs it over the ROMs in
+    chip8-test-rom, or the ones in BENCH_ROMS.
+*/
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define HANDLER_CALLS (1 << 22)
+/* Instructions per core call in ROM runs, followed by a timer tick */
+#define ROM_SLICE 1000
+/* Machines in the batch and environments in the vectorized environment */
+#define BATCH_LANES 4096
+/* Steps of one frame per vectorized environment run */
+#define ENV_STEPS 64
+
+static double seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int count){
+    qsort(values, count, sizeof(double), compare_doubles);
+    return values[count / 2];
+}
+
+/* Separates the entries of the results array */
+static const char *separator = "";
+
+/* ROM names are paths, which may hold quotes and backslashes */
+static void print_string(const char *s){
+    putchar('"');
+    for(; *s != '\0'; s++){
+        if(*s == '"' || *s == '\\'){
+            putchar('\\');
+        }
+        if((unsigned char)*s < 0x20){
+            printf("\\u%04x", *s);
+        }else{
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static void print_result(const char *group, const char *name, const char *core, double value, const char *unit){
+    printf("%s\n    {\"group\": \"%s\", \"name\": ", separator, group);
+    print_string(name);
+    printf(", \"core\": \"%s\", \"%s\": %.3f}", core, unit, value);
+    separator = ",";
+    fflush(stdout);
+}
+
+/*
+    Handler microbenchmarks. Each one calls a cpu.c handler with fixed
+    operands, i is there so that the register values keep changing.
+*/
+static void bench_cls(struct chip8 *chip, unsigned i){ cls(chip); }
+static void bench_jmp(struct chip8 *chip, unsigned i){ jmp(chip, 0x200 + (i & 0xfe)); }
+static void bench_call_ret(struct chip8 *chip, unsigned i){ call(chip, 0x300); ret(chip); }
+static void bench_iskip_on_equal(struct chip8 *chip, unsigned i){ iskip_on_equal(chip, i & 0xf, i); }
+static void bench_iskip_on_not_equal(struct chip8 *chip, unsigned i){ iskip_on_not_equal(chip, i & 0xf, i); }
+static void bench_skip_on_equal(struct chip8 *chip, unsigned i){ skip_on_equal(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_iload(struct chip8 *chip, unsigned i){ iload(chip, i & 0xf, i); }
+static void bench_iadd(struct chip8 *chip, unsigned i){ iadd(chip, i & 0xf, i); }
+static void bench_assign(struct chip8 *chip, unsigned i){ assign(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_or(struct chip8 *chip, unsigned i){ _or(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_and(struct chip8 *chip, unsigned i){ _and(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_xor(struct chip8 *chip, unsigned i){ _xor(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_add(struct chip8 *chip, unsigned i){ add(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_sub(struct chip8 *chip, unsigned i){ sub(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_shr(struct chip8 *chip, unsigned i){ shr(chip, i & 0xf); }
+static void bench_subn(struct chip8 *chip, unsigned i){ subn(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_shl(struct chip8 *chip, unsigned i){ shl(chip, i & 0xf); }
+static void bench_skip_on_not_equal(struct chip8 *chip, unsigned i){ skip_on_not_equal(chip, i & 0xf, (i >> 4) & 0xf); }
+static void bench_set_index(struct chip8 *chip, unsigned i){ set_index(chip, 0x300 + (i & 0xff)); }
+static void bench_jmp_rel(struct chip8 *chip, unsigned i){ jmp_rel(chip, 0x200); }
+static void bench_set_rand(struct chip8 *chip, unsigned i){ set_rand(chip, i & 0xf, 0xff); }
+static void bench_display_sprite(struct chip8 *chip, unsigned i){
+    chip->index_register = 0x50 + (i & 0xf) * 5;
+    display_sprite(chip, i & 0xf, (i >> 4) & 0xf, 5);
+}
+static void bench_skip_pressed(struct chip8 *chip, unsigned i){ skip_pressed(chip, i & 0xf); }
+static void bench_skip_not_pressed(struct chip8 *chip, unsigned i){ skip_not_pressed(chip, i & 0xf); }
+static void bench_load_delay(struct chip8 *chip, unsigned i){ load_delay(chip, i & 0xf); }
+static void bench_wait_for_key(struct chip8 *chip, unsigned i){
+    wait_for_key(chip, i & 0xf);
+    chip->waiting_for_key = 0;
+}
+static void bench_set_delay(struct chip8 *chip, unsigned i){ set_delay(chip, i & 0xf); }
+static void bench_set_sound(struct chip8 *chip, unsigned i){ set_sound(chip, i & 0xf); }
+static void bench_add_to_index(struct chip8 *chip, unsigned i){ add_to_index(chip, i & 0xf); }
+static void bench_load_location(struct chip8 *chip, unsigned i){ load_location(chip, i & 0xf); }
+static void bench_store_bcd(struct chip8 *chip, unsigned i){
+    chip->index_register = 0xe00;
+    store_bcd(chip, i & 0xf);
+}
+static void bench_store_registers(struct chip8 *chip, unsigned i){
+    chip->index_register = 0xe00;
+    store_registers(chip, 0xf);
+}
+static void bench_load_registers(struct chip8 *chip, unsigned i){
+    chip->index_register = 0xe00;
+    load_registers(chip, 0xf);
+}
+
+struct handler_bench{
+    const char *name;
+    void (*run)(struct chip8 *, unsigned);
+};
+
+static const struct handler_bench handler_benches[] = {
+    {"00E0 cls", bench_cls},
+    {"1nnn jmp", bench_jmp},
+    {"2nnn+00EE call+ret", bench_call_ret},
+    {"3xkk iskip_on_equal", bench_iskip_on_equal},
+    {"4xkk iskip_on_not_equal", bench_iskip_on_not_equal},
+    {"5xy0 skip_on_equal", bench_skip_on_equal},
+    {"6xkk iload", bench_iload},
+    {"7xkk iadd", bench_iadd},
+    {"8xy0 assign", bench_assign},
+    {"8xy1 or", bench_or},
+    {"8xy2 and", bench_and},
+    {"8xy3 xor", bench_xor},
+    {"8xy4 add", bench_add},
+    {"8xy5 sub", bench_sub},
+    {"8xy6 shr", bench_shr},
+    {"8xy7 subn", bench_subn},
+    {"8xyE shl", bench_shl},
+    {"9xy0 skip_on_not_equal", bench_skip_on_not_equal},
+    {"Annn set_index", bench_set_index},
+    {"Bnnn jmp_rel", bench_jmp_rel},
+    {"Cxkk set_rand", bench_set_rand},
+    {"Dxy5 display_sprite", bench_display_sprite},
+    {"Ex9E skip_pressed", bench_skip_pressed},
+    {"ExA1 skip_not_pressed", bench_skip_not_pressed},
+    {"Fx07 load_delay", bench_load_delay},
+    {"Fx0A wait_for_key", bench_wait_for_key},
+    {"Fx15 set_delay", bench_set_delay},
+    {"Fx18 set_sound", bench_set_sound},
+    {"Fx1E add_to_index", bench_add_to_index},
+    {"Fx29 load_location", bench_load_location},
+    {"Fx33 store_bcd", bench_store_bcd},
+    {"FF55 store_registers", bench_store_registers},
+    {"FF65 load_registers", bench_load_registers},
+};
+
+static void run_handler_benches(struct chip8 *chip, int repeats){
+    double *samples = malloc(repeats * sizeof(double));
+
+    for(size_t b = 0; b < sizeof(handler_benches) / sizeof(handler_benches[0]); b++){
+        for(int r = 0; r < repeats; r++){
+            init_chip8(chip);
+            seed_chip8(chip, 1);
+            double start = seconds();
+            for(unsigned i = 0; i < HANDLER_CALLS; i++){
+                handler_benches[b].run(chip, i);
+            }
+            samples[r] = (seconds() - start) / HANDLER_CALLS * 1e9;
+            release_chip8(chip);
+        }
+        print_result("handler", handler_benches[b].name, "direct", median(samples, repeats), "ns_per_call");
+    }
+    free(samples);
+}
+
+/* Assembles a ROM from instruction words, returns its size in bytes */
+static size_t assemble(unsigned char *rom, const unsigned short *words, size_t count){
+    for(size_t i = 0; i < count; i++){
+        rom[2 * i] = words[i] >> 8;
+        rom[2 * i + 1] = words[i] & 0xff;
+    }
+    return 2 * count;
+}
+
+/* Straight line arithmetic, one dispatch per instruction and nothing else */
+static size_t synthetic_dispatch(unsigned char *rom){
+    static const unsigned short alu[] = {0x8014, 0x7103, 0x8125, 0x8230, 0x8341, 0x6455, 0x8452, 0x8563, 0x7607, 0x8676};
+    unsigned short words[256];
+    size_t count = 0;
+    for(int i = 0; i < 200; i++){
+        words[count++] = alu[i % 10];
+    }
+    words[count++] = 0x1200;
+    return assemble(rom, words, count);
+}
+
+/* Dxyn with moving coordinates and sprite heights 1 to 15 */
+static size_t synthetic_sprite(unsigned char *rom){
+    static const unsigned short words[] = {
+        0xA300, 0xD01F, 0x7007, 0xD015, 0x7103, 0xD018, 0x7005, 0xD011,
+        0x710B, 0xD01A, 0xA310, 0xD01F, 0x7009, 0xD013, 0x1202
+    };
+    size_t size = assemble(rom, words, sizeof(words) / sizeof(words[0]));
+    /* Sprite data at 0x300 */
+    for(int i = 0; i < 32; i++){
+        rom[0x100 + i] = 0x5a ^ (i * 37);
+    }
+    return size > 0x120 ? size : 0x120;
+}
+
+/* Fx55 and Fx65 of all sixteen registers, with I moving around */
+static size_t synthetic_memory(unsigned char *rom){
+    static const unsigned short words[] = {
+        0xA400, 0xFF55, 0xFF65, 0x7001, 0xF01E, 0xF755, 0xF765, 0xFF55,
+        0xA480, 0xFF65, 0xF355, 0xF365, 0x1202
+    };
+    return assemble(rom, words, sizeof(words) / sizeof(words[0]));
+}
+
+/* Skips, calls and returns, the control flow a game loop is made of */
+static size_t synthetic_branch(unsigned char *rom){
+    static const unsigned short words[] = {
+        /* 0x200 */ 0x7001, 0x3000, 0x2220, 0x4100, 0x2224, 0x5010, 0x7101, 0x9010,
+        /* 0x210 */ 0x7201, 0x3280, 0x1200, 0x6200, 0x1200, 0x0000, 0x0000, 0x0000,
+        /* 0x220 */ 0x7301, 0x00EE, 0x8134, 0x00EE
+    };
+    return assemble(rom, words, sizeof(words) / sizeof(words[0]));
+}
+
+struct core_bench{
+    const char *name;
+    core_fn core;
+};
+
+/* The quirks cores, called through the factory once per slice */
+static long quirks_none(struct chip8 *chip, long budget){
+    return quirks_core(0)(chip, budget);
+}
+
+static long quirks_vip(struct chip8 *chip, long budget){
+    return quirks_core(CHIP8_QUIRKS_VIP)(chip, budget);
+}
+
+static const struct core_bench cores[] = {
+    {"switch", decode},
+    {"threaded", decode_threaded},
+    {"jit", decode_jit},
+    {"quirks", quirks_none},
+    {"quirks-vip", quirks_vip},
+};
+
+/*
+    Runs a core over a loaded machine for the given number of instructions
+    and returns millions of instructions per second. ROM runs tick the
+    timers and press a key now and then, like frames would.
+*/
+static double measure(struct chip8 *chip, core_fn core, long instructions){
+    long executed = 0;
+    long slices = 0;
+    double start = seconds();
+
+    while(executed < instructions){
+        long slice = instructions - executed < ROM_SLICE ? instructions - executed : ROM_SLICE;
+        if(slices % 8 == 0){
+            unsigned short key = 1 << ((slices / 8) % 16);
+            set_keypad(chip, key, key);
+        }
+        poll_keys(chip);
+        long done = chip->waiting_for_key ? 0 : core(chip, slice);
+        if(done < 0){
+            break;
+        }
+        executed += done;
+        tick_timers(chip);
+        slices++;
+        /* A ROM that only waits would never get to the count */
+        if(slices > instructions){
+            break;
+        }
+    }
+    double elapsed = seconds() - start;
+    return executed / elapsed / 1e6;
+}
+
+/*
+    measure() on BATCH_LANES copies of the machine, lane l seeded with
+    1 + l, until the lanes executed instructions between them. Returns
+    millions of instructions per second over all lanes, or -1.
+*/
+static double measure_batch(struct chip8 *chip, long instructions){
+    chip->instructions_per_frame = ROM_SLICE;
+    struct chip8_batch *b = new_chip8_batch(BATCH_LANES, chip);
+    if(b == NULL){
+        return -1;
+    }
+    seed_chip8_batch(b, 1);
+
+    long executed = 0;
+    long slices = 0;
+    double start = seconds();
+    while(executed < instructions){
+        if(slices % 8 == 0){
+            int key = (slices / 8) % 16;
+            memset(b->keys, 0, 16 * b->stride);
+            memset(b->keys + key * b->stride, 1, b->lanes);
+        }
+        executed += batch_run_frame(b);
+        slices++;
+        if(slices > instructions){
+            break;
+        }
+    }
+    double elapsed = seconds() - start;
+    free_chip8_batch(b);
+    return executed / elapsed / 1e6;
+}
+
+/*
+    ENV_STEPS steps of one frame on BATCH_LANES environments of the ROM,
+    with the actions changing like the keys of measure(). Returns
+    environment steps per second, or -1.
+*/
+static double measure_env(const unsigned char *rom, size_t size){
+    uint64_t *observations = malloc(BATCH_LANES * DISPLAY_HEIGTH * sizeof(uint64_t));
+    float *rewards = malloc(BATCH_LANES * sizeof(float));
+    unsigned char *dones = malloc(BATCH_LANES);
+    uint16_t *actions = malloc(BATCH_LANES * sizeof(uint16_t));
+    struct chip8_vec_env_buffers buffers = {observations, rewards, dones};
+    struct chip8_vec_env *env = NULL;
+    if(observations != NULL && rewards != NULL && dones != NULL && actions != NULL){
+        env = new_chip8_vec_env(rom, size, BATCH_LANES, 1, NULL, 0, &buffers);
+    }
+
+    double steps = -1;
+    if(env != NULL){
+        double start = seconds();
+        for(int step = 0; step < ENV_STEPS; step++){
+            for(size_t l = 0; l < BATCH_LANES; l++){
+                actions[l] = 1 << ((step / 8 + l) % 16);
+            }
+            chip8_vec_env_step(env, actions, 1);
+        }
+        steps = (double)ENV_STEPS * BATCH_LANES / (seconds() - start);
+        free_chip8_vec_env(env);
+    }
+    free(observations);
+    free(rewards);
+    free(dones);
+    free(actions);
+    return steps;
+}
+
+static void run_core_benches(struct chip8 *chip, const char *group, const char *name,
+        const unsigned char *rom, size_t size, long instructions, int repeats){
+    double *samples = malloc(repeats * sizeof(double));
+
+    for(size_t c = 0; c < sizeof(cores) / sizeof(cores[0]); c++){
+        for(int r = 0; r < repeats; r++){
+            init_chip8(chip);
+            seed_chip8(chip, 1);
+            load_rom_buffer(chip, rom, size);
+            samples[r] = measure(chip, cores[c].core, instructions);
+            release_chip8(chip);
+        }
+        print_result(group, name, cores[c].name, median(samples, repeats), "mips");
+    }
+
+    for(int r = 0; r < repeats; r++){
+        init_chip8(chip);
+        load_rom_buffer(chip, rom, size);
+        samples[r] = measure_batch(chip, instructions);
+        release_chip8(chip);
+    }
+    print_result(group, name, "batch", median(samples, repeats), "mips");
+
+    for(int r = 0; r < repeats; r++){
+        samples[r] = measure_env(rom, size);
+    }
+    print_result(group, name, "vec_env", median(samples, repeats), "env_steps_per_s");
+    free(samples);
+}
+
+/* Reads a ROM file into rom, returns its size or -1 */
+static long read_rom(const char *path, unsigned char *rom, size_t capacity){
+    FILE *fd = fopen(path, "rb");
+    if(fd == NULL){
+        perror(path);
+        return -1;
+    }
+    size_t size = fread(rom, 1, capacity, fd);
+    fclose(fd);
+    return size;
+}
+
+int main(int argc, char **argv){
+    long instructions = 20000000;
+    int repeats = 5;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:r:")) != -1){
+        switch(opt){
+            case 'n': {
+                instructions = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 'r': {
+                repeats = strtol(optarg, NULL, 0);
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: %s [-n instructions] [-r repeats] [rom...]\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    if(repeats < 1){
+        repeats = 1;
+    }
+
+    struct chip8 *chip = malloc(sizeof(struct chip8));
+    unsigned char rom[4096 - 0x200];
+    if(chip == NULL){
+        perror("Machine allocation failed");
+        return 1;
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"instructions\": %ld,\n  \"repeats\": %d,\n  \"results\": [",
+            BENCH_VERSION, instructions, repeats);
+    run_handler_benches(chip, repeats);
+
+    static const struct{
+        const char *name;
+        size_t (*build)(unsigned char *);
+    } synthetic[] = {
+        {"dispatch", synthetic_dispatch},
+        {"sprite", synthetic_sprite},
+        {"memory", synthetic_memory},
+        {"branch", synthetic_branch},
+    };
+    for(size_t s = 0; s < sizeof(synthetic) / sizeof(synthetic[0]); s++){
+        memset(rom, 0, sizeof(rom));
+        size_t size = synthetic[s].build(rom);
+        run_core_benches(chip, "synthetic", synthetic[s].name, rom, size, instructions, repeats);
+    }
+
+    for(int i = optind; i < argc; i++){
+        long size = read_rom(argv[i], rom, sizeof(rom));
+        if(size >= 0){
+            run_core_benches(chip, "rom", argv[i], rom, size, instructions, repeats);
+        }
+    }
+    printf("\n  ]\n}\n");
+    free(chip);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <string.h>
+#include "condition.h"
+
+/* Parses "address op value" with op one of == != < <= > >=, returns -1 if it is not one */
+int parse_condition(const char *text, struct condition *condition){
+    static const char *const operators[] = {"==", "!=", "<", "<=", ">", ">="};
+    char op[3];
+    int address, value;
+
+    if(sscanf(text, "%i %2[=!<>] %i", &address, op, &value) != 3 || address < 0 || address > 0xfff ||
+            value < 0 || value > 0xff){
+        return -1;
+    }
+    for(int i = 0; i < 6; i++){
+        if(strcmp(op, operators[i]) == 0){
+            condition->set = 1;
+            condition->address = address;
+            condition->comparison = i;
+            condition->value = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Whether the machine meets the condition, never for one that is not set */
+int condition_met(const struct condition *condition, const struct chip8 *chip){
+    if(!condition->set){
+        return 0;
+    }
+    unsigned char byte = chip->memory[condition->address];
+    switch(condition->comparison){
+        case COMPARE_EQ: return byte == condition->value;
+        case COMPARE_NE: return byte != condition->value;
+        case COMPARE_LT: return byte < condition->value;
+        case COMPARE_LE: return byte <= condition->value;
+        case COMPARE_GT: return byte > condition->value;
+        case COMPARE_GE: return byte >= condition->value;
+    }
+    return 0;
+}
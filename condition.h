@@ -0,0 +1,26 @@
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include "cpu.h"
+
+enum comparison{
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE
+};
+
+/* A test of one memory byte against a value, "address op value" on the command line */
+struct condition{
+    int set;
+    unsigned short address;
+    enum comparison comparison;
+    unsigned char value;
+};
+
+int parse_condition(const char *, struct condition *);
+int condition_met(const struct condition *, const struct chip8 *);
+
+#endif
@@ -6,36 +6,66 @@
 #include <time.h>
 #include "stack.h"
 #include "font.h"
+#include "cpu.h"
+#include "jit.h"
+#include "decoder.h"
 
 #define START_ADDRESS 0x200
 #define MEMORY_CAPACITY ((1<<12) - 0x200)
 #define FONT_START_ADDRESS 0x50
 
-#define DISPLAY_WIDTH 64
-#define DISPLAY_HEIGTH 32
-struct chip8{
-    unsigned char registers[16];
-    unsigned char memory[4096];
-    unsigned short index_register;
-    unsigned short pc;
-    unsigned short stack[16];
-    unsigned char sp;
-    unsigned char delay_timer;
-    unsigned char sound_timer;
-    unsigned char keys[16];
-    unsigned char display_memory[256];
-};
-
-
-void load_fonts(struct chip8 *);
+/*
+    Prepares a machine in caller provided memory, which does not need to be
+    zeroed. Pair with release_chip8().
+*/
+void init_chip8(struct chip8 *chip){
+    /* Zeroed, so that the decode cache starts out empty */
+    memset(chip, 0, sizeof(struct chip8));
+    chip->pc = 0x200;
+    chip->fusion_enabled = 1;
+    chip->idle_detection = 1;
+    chip->instructions_per_frame = INSTRUCTIONS_PER_FRAME;
+    init_keypad(&chip->keypad);
+    seed_chip8(chip, time(NULL));
+    load_fonts(chip);
+}
+
+/* Frees what a machine owns, but not the machine itself */
+void release_chip8(struct chip8 *chip){
+    if(chip->jit != NULL){
+        free_jit(chip->jit);
+        chip->jit = NULL;
+    }
+    destroy_keypad(&chip->keypad);
+}
 
 struct chip8 *new_chip8(){
     struct chip8 *ret = (struct chip8*)malloc(sizeof(struct chip8));
-    ret->pc = 0x200;
-    load_fonts(ret);
+    if(ret == NULL){
+        perror("Machine allocation failed");
+        return NULL;
+    }
+    init_chip8(ret);
     return ret;
 }
 
+void free_chip8(struct chip8 *chip){
+    release_chip8(chip);
+    free(chip);
+}
+
+/* The xorshift state for a seed, with the seed bits spread out and never 0 */
+unsigned int rng_state_for_seed(unsigned int seed){
+    unsigned int state = seed * 0x9e3779b9u + 0x6d2b79f5u;
+    /* xorshift gets stuck on an all zero state */
+    return state != 0 ? state : 0x6d2b79f5u;
+}
+
+/* Seeds the random generator used by Cxkk, the same seed gives the same sequence */
+void seed_chip8(struct chip8 *chip, unsigned int seed){
+    chip->rng_state = rng_state_for_seed(seed);
+}
+
 void load_rom(struct chip8 *chip, const char *path){
     FILE *fd = fopen(path, "r");
     if(fd == NULL){
@@ -49,6 +79,7 @@ void load_rom(struct chip8 *chip, const char *path){
     if(file_size > MEMORY_CAPACITY){
         perror("File to large to fit into memory");
         errno = ENOMEM;
+        fclose(fd);
         return;
     }
 
@@ -56,15 +87,24 @@ void load_rom(struct chip8 *chip, const char *path){
     /* Reset the cursor to the beginning of the file */
     fseek(fd, 0, SEEK_SET);
     fread(buffer, file_size, 1, fd);
+    fclose(fd);
 
-    /* Transfer the ROM data into the chip's memory */
-    for(size_t i = 0; i < file_size; i++){
-        /* There is reserved memory space from 0x0 to 0x1ff */
-        chip->memory[START_ADDRESS + i] = *((unsigned char *)buffer + i);
-    }
+    load_rom_buffer(chip, buffer, file_size);
     free(buffer);
 }
 
+/* Copies a ROM image into memory. Returns -1 if it does not fit. */
+int load_rom_buffer(struct chip8 *chip, const unsigned char *rom, size_t size){
+    if(size > MEMORY_CAPACITY){
+        errno = ENOMEM;
+        return -1;
+    }
+    /* There is reserved memory space from 0x0 to 0x1ff */
+    memcpy(chip->memory + START_ADDRESS, rom, size);
+    invalidate_decode_cache(chip);
+    return 0;
+}
+
 void load_fonts(struct chip8 *chip){
     /* Fonts are loaded into memory at address 0x50 */
     for(size_t i = 0; i < FONTSET_SIZE; i++){
@@ -72,18 +112,27 @@ void load_fonts(struct chip8 *chip){
     }
 }
 
+/* Called at 60Hz, counts both timers down to 0 */
+void tick_timers(struct chip8 *chip){
+    if(chip->delay_timer > 0){
+        chip->delay_timer--;
+    }
+    if(chip->sound_timer > 0){
+        chip->sound_timer--;
+    }
+}
+
 /* Clears the display memory */
 void cls(struct chip8 *chip){
-    memset(chip->display_memory, 0, 2048);
+    memset(chip->display_memory, 0, sizeof(chip->display_memory));
+    chip->dirty_rows = 0xffffffff;
     chip->pc += 2;
 }
 
 /* Return from a subroutine */
 void ret(struct chip8 *chip){
-    /* Sets the PC to the address at the top of the stack,
-    then substract 1 from SP */
-    chip->pc = chip->stack[chip->sp];
-    chip->sp--;
+    /* Pops the return address pushed by call */
+    chip->pc = pop(chip->stack, &chip->sp);
 }
 
 /* Jump to location nnn */
@@ -93,7 +142,8 @@ void jmp(struct chip8 *chip, unsigned short nnn){
 
 /* Call subroutine at nnn */
 void call(struct chip8 *chip, unsigned short nnn){
-    push(chip->stack, chip->sp, chip->pc);
+    /* Return to the instruction following the call */
+    push(chip->stack, &chip->sp, chip->pc + 2);
     chip->pc = nnn;
 }
 
@@ -226,51 +276,48 @@ void jmp_rel(struct chip8 *chip, unsigned short nnn){
 
 /* Vx = random byte & kk */
 void set_rand(struct chip8 *chip, unsigned short x, unsigned char kk){
-    srandom(time(NULL));
-    unsigned char r = random() % 256;
-    chip->registers[x] = r & kk;
+    unsigned int r = chip->rng_state;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    chip->rng_state = r;
+    /* The high bits are the better mixed ones */
+    chip->registers[x] = (r >> 24) & kk;
     chip->pc += 2;
 }
 
-/* 
-    Display sprite (stored in the memory starting at address index_register) 
+/*
+    Display sprite (stored in the memory starting at address index_register)
     on the screen, starting at coordinates (Vx, Vy). The size of the sprite is n (<= 15).
+    Each sprite byte becomes one rotate and one XOR on a display row, so the
+    sprite wraps around both edges of the screen. VF is set to 1 if any lit
+    pixel was erased.
 */
 void display_sprite(struct chip8 *chip, unsigned short x, unsigned short y, unsigned short n){
-    unsigned char x_pos = chip->registers[x];
-    unsigned char y_pos = chip->registers[y];
+    unsigned char x_pos = chip->registers[x] % DISPLAY_WIDTH;
+    unsigned char y_pos = chip->registers[y] % DISPLAY_HEIGTH;
+    uint64_t erased = 0;
 
-    if(n > 15){
-        fprintf(stderr, "Sprite size %hu is invalid. Must be <= 15\n", n);
-        return;
-    }
-    /* Display is 64 x 32 */
-    if(x_pos % 8 != 0 || y_pos % 8 != 0){
-        //fprintf(stderr, "Screen coordinates must be byte aligned (%hhu, %hhu)\n", x_pos, y_pos);
-        //return;
-    }
-    if(x_pos >= DISPLAY_WIDTH || y_pos >= DISPLAY_HEIGTH){
-        //fprintf(stderr, "Coordinates out of screen (%hhu, %hhu)\n", x_pos, y_pos);
-        return;
-    }
-    chip->registers[0xf] = 0;
     for(unsigned short i = 0; i < n; i++){
-        int display_index = (y_pos + i * DISPLAY_WIDTH + x_pos) % 2048;
-        unsigned char sprite_byte = chip->memory[chip->index_register + i];
-
-        /* VF is set to 1 if any pixel was erased */ 
-        if((sprite_byte ^ chip->display_memory[display_index]) == 0 && 
-                chip->display_memory[display_index] == 1){
-            chip->registers[0xf] = 1;
+        uint64_t sprite_row = (uint64_t)chip->memory[(chip->index_register + i) & 0xfff] << 56;
+        sprite_row = (sprite_row >> x_pos) | (sprite_row << ((DISPLAY_WIDTH - x_pos) & 63));
+
+        unsigned char row_index = (y_pos + i) % DISPLAY_HEIGTH;
+        uint64_t *row = &chip->display_memory[row_index];
+        erased |= *row & sprite_row;
+        *row ^= sprite_row;
+        if(sprite_row){
+            chip->dirty_rows |= 1u << row_index;
         }
-        chip->display_memory[display_index] ^= sprite_byte; 
     }
+    chip->registers[0xf] = erased != 0;
     chip->pc += 2;
 }
 
 /* Skip the next instruction if a key is pressed */
 void skip_pressed(struct chip8 *chip, unsigned short x){
-    unsigned char key = chip->registers[x];
+    /* Only the low nibble names a key */
+    unsigned char key = chip->registers[x] & 0xf;
     if(chip->keys[key] == 1){
         chip->pc += 2;
     }
@@ -279,7 +326,7 @@ void skip_pressed(struct chip8 *chip, unsigned short x){
 
 /* Skip the next instruction if a key is NOT pressed */
 void skip_not_pressed(struct chip8 *chip, unsigned short x){
-    unsigned char key = chip->registers[x];
+    unsigned char key = chip->registers[x] & 0xf;
     if(chip->keys[key] == 0){
         chip->pc += 2;
     }
@@ -288,22 +335,16 @@ void skip_not_pressed(struct chip8 *chip, unsigned short x){
 
 void load_delay(struct chip8 *chip, unsigned short x){
     chip->registers[x] = chip->delay_timer;
+    chip->pc += 2;
 }
 
-/* Pause the execution until a key is pressed */
+/*
+    Pause the execution until a key is pressed. The PC stays on the Fx0A
+    until poll_keys() delivers a key press.
+*/
 void wait_for_key(struct chip8 *chip, unsigned short x){
-    unsigned char keys_copy[16];
-    memcpy(keys_copy, chip->keys, 16);
-    while(1){
-        for(int i = 0; i < 16; i++){
-            if(chip->keys[i] != keys_copy[i]){
-                chip->registers[x] = i;
-                return;
-            }
-        }
-        usleep(10000);
-    }
-    chip->pc += 2;
+    chip->waiting_for_key = 1;
+    chip->key_register = x;
 }
 
 /* Delay timer = Vx */
@@ -329,32 +370,68 @@ void load_location(struct chip8 *chip, unsigned short x){
     chip->pc += 2;
 }
 
-/* Store BCD representation of the value in Vx into mem[I, I+1, I+2] */
+/*
+    Store BCD representation of the value in Vx into mem[I, I+1, I+2].
+    I can be anything after Fx1E, addresses wrap around the 4K like
+    display_sprite() does.
+*/
 void store_bcd(struct chip8 *chip, unsigned short x){
     unsigned char xreg_value = chip->registers[x];
-    unsigned char hundreds = xreg_value / 100;
-    unsigned char tens = (xreg_value - hundreds) / 10;
-    unsigned char units = xreg_value % 10; 
-    chip->memory[chip->index_register] = hundreds;
-    chip->memory[chip->index_register + 1] = tens;
-    chip->memory[chip->index_register + 2] = units;
+    unsigned char digits[3] = {xreg_value / 100, xreg_value / 10 % 10, xreg_value % 10};
+    for(int i = 0; i < 3; i++){
+        unsigned short address = (chip->index_register + i) & 0xfff;
+        chip->memory[address] = digits[i];
+        invalidate_decoded(chip, address);
+    }
 
     chip->pc += 2;
 }
 
 /* Store registers V0 to Vx into memory starting at location I */
 void store_registers(struct chip8 *chip, unsigned short x){
-    for(int i = 0; i < x; i++){
-        chip->memory[chip->index_register + i] = chip->registers[i];
+    for(int i = 0; i <= x; i++){
+        unsigned short address = (chip->index_register + i) & 0xfff;
+        chip->memory[address] = chip->registers[i];
+        invalidate_decoded(chip, address);
     }
     chip->pc += 2;
 }
 
 /* Load values from memory (starting at address I) into registers V0 to Vx */
 void load_registers(struct chip8 *chip, unsigned short x){
-    for(int i = 0; i < x; i++){
-        chip->registers[i] = chip->memory[chip->index_register + i];
+    for(int i = 0; i <= x; i++){
+        chip->registers[i] = chip->memory[(chip->index_register + i) & 0xfff];
     }
     chip->pc += 2;
 }
 
+/*
+    Superinstructions: pairs that show up back to back often enough to be
+    worth a single dispatch. predecode_at() builds them.
+*/
+
+/* Vx = kk, then draw a sprite */
+void iload_display_sprite(struct chip8 *chip, unsigned short x, unsigned char kk,
+        unsigned short x2, unsigned short y2, unsigned short n){
+    iload(chip, x, kk);
+    display_sprite(chip, x2, y2, n);
+}
+
+/* I = nnn, then I = I + Vx */
+void set_index_add_to_index(struct chip8 *chip, unsigned short nnn, unsigned short x){
+    chip->index_register = nnn + chip->registers[x];
+    chip->pc += 4;
+}
+
+/* Vx = Vx + kk, then skip if Vx2 = kk2 */
+void iadd_iskip_on_equal(struct chip8 *chip, unsigned short x, unsigned char kk,
+        unsigned short x2, unsigned char kk2){
+    chip->registers[x] += kk;
+    chip->pc += chip->registers[x2] == kk2 ? 6 : 4;
+}
+
+/* Vx = delay timer, then skip if Vx2 = kk */
+void load_delay_iskip_on_equal(struct chip8 *chip, unsigned short x, unsigned short x2, unsigned char kk){
+    chip->registers[x] = chip->delay_timer;
+    chip->pc += chip->registers[x2] == kk ? 6 : 4;
+}
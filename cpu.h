@@ -1,4 +1,24 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "predecode.h"
+#include "keypad.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGTH 32
+
+struct jit;
+struct triple_buffer;
+struct chip8_profile;
+
 struct chip8{
+    /* Machine state, up to rng_state. savestate.c copies it as one block. */
     unsigned char registers[16];
     unsigned char memory[4096];
     unsigned short index_register;
@@ -8,13 +28,45 @@ struct chip8{
     unsigned char delay_timer;
     unsigned char sound_timer;
     unsigned char keys[16];
-    unsigned char display_memory[256];
+    /* Set by Fx0A, the machine is stopped until poll_keys() sees a press */
+    unsigned char waiting_for_key;
+    unsigned char key_register;
+    /* One row per word, the most significant bit is the leftmost pixel */
+    uint64_t display_memory[DISPLAY_HEIGTH];
+    /* Bit n is set when row n changed, the presentation layer clears it */
+    uint32_t dirty_rows;
+    /* xorshift32 state for Cxkk, never 0 */
+    unsigned int rng_state;
+
+    /* One predecoded entry per even address, see predecode.c */
+    struct decoded_instruction decode_cache[DECODE_CACHE_SIZE];
+    /* Whether predecode_at() may merge instruction pairs */
+    unsigned char fusion_enabled;
+    /* Whether predecode_at() may collapse idle loops, which skips over their addresses */
+    unsigned char idle_detection;
+    unsigned long fusion_counts[FUSED_OP_COUNT];
+    /* Instructions run_frame() executes between two timer ticks */
+    unsigned short instructions_per_frame;
+    /* Recompiler state, created on demand by decode_jit() */
+    struct jit *jit;
+    struct keypad keypad;
+    /* When set, run_frame() publishes every completed frame here */
+    struct triple_buffer *output;
+    /* When set in a CHIP8_PROFILE build, decode() counts into it */
+    struct chip8_profile *profile;
 };
 
 void load_fonts(struct chip8 *);
+void init_chip8(struct chip8 *);
+void release_chip8(struct chip8 *);
 struct chip8 *new_chip8();
+void free_chip8(struct chip8 *);
+unsigned int rng_state_for_seed(unsigned int);
+void seed_chip8(struct chip8 *, unsigned int);
 void load_rom(struct chip8 *, const char *);
+int load_rom_buffer(struct chip8 *, const unsigned char *, size_t);
 void load_fonts(struct chip8 *);
+void tick_timers(struct chip8 *);
 void cls(struct chip8 *);
 void ret(struct chip8 *);
 void jmp(struct chip8 *, unsigned short);
@@ -49,4 +101,13 @@ void load_location(struct chip8 *, unsigned short);
 void store_bcd(struct chip8 *, unsigned short);
 void store_registers(struct chip8 *, unsigned short);
 void load_registers(struct chip8 *, unsigned short);
+void iload_display_sprite(struct chip8 *, unsigned short, unsigned char, unsigned short, unsigned short, unsigned short);
+void set_index_add_to_index(struct chip8 *, unsigned short, unsigned short);
+void iadd_iskip_on_equal(struct chip8 *, unsigned short, unsigned char, unsigned short, unsigned char);
+void load_delay_iskip_on_equal(struct chip8 *, unsigned short, unsigned short, unsigned char);
+
+#ifdef __cplusplus
+}
+#endif
 
+#endif
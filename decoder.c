@@ -6,227 +6,327 @@
 #include <time.h>
 #include "stack.h"
 #include "cpu.h"
+#include "decoder.h"
+#include "triple_buffer.h"
+#include "profile.h"
 #include <assert.h>
 
-void decode(struct chip8 *chip){
+/*
+    Reference decoder: executes a single instruction straight from its
+    encoding. Returns -1 if the instruction is invalid and 1 if the machine
+    is now waiting for a key.
+*/
+int execute(struct chip8 *chip, unsigned short instruction){
+    unsigned char opcode = (instruction & 0xf000) >> 12;
 
-    while(1){
-        if(chip->pc >= 0x1000){
-            perror("Invalid memory address\n");
-            return;
-        }
-        unsigned short instruction = chip->memory[chip->pc] << 8 | chip->memory[chip->pc + 1];
-        unsigned char opcode = (instruction & 0xf000) >> 12;
-        
-        switch(opcode){
-            case 0x0: {
-                switch(instruction & 0x0fff){
-                    case 0x00e0: {
-                        cls(chip);
-                    }
-                    case 0x00ee: {
-                        ret(chip);
-                    }
+    switch(opcode){
+        case 0x0: {
+            switch(instruction & 0x0fff){
+                case 0x00e0: {
+                    cls(chip);
+                    break;
+                }
+                case 0x00ee: {
+                    ret(chip);
+                    break;
+                }
+                default: {
+                    return -1;
                 }
             }
-            case 0x1: {
-                unsigned short jump_addr = instruction & 0x0fff;
-                jmp(chip, jump_addr);
-                break;
-            }
-            case 0x2: {
-                unsigned short jump_addr = instruction & 0x0fff;
-                call(chip, jump_addr);
-                break;
-            }
-            case 0x3: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned char kk = instruction & 0x00ff;
-                iskip_on_equal(chip, x, kk);
-                break;
-            }
-            case 0x4: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned char kk = instruction & 0x00ff;
-                iskip_on_not_equal(chip, x, kk);
-                break;
-            }
-            case 0x5: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned short y = (instruction & 0x00f0) >> 4;
-                skip_on_equal(chip, x, y);
-                break;
-            }
-            case 0x6: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned char kk = instruction & 0x00ff;
-                iload(chip, x, kk);
-                break;
-            }
-            case 0x7: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned char kk = instruction & 0x00ff;
-                iadd(chip, x, kk);
-                break;
-            }
-            case 0x8: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned short y = (instruction & 0x00f0) >> 4;
-                switch(instruction & 0xf){
-                    case 0: {
-                        assign(chip, x, y);
-                        break;
-                    }
-                    case 1: {
-                        _or(chip, x, y);
-                        break;
-                    }
-                    case 2: {
-                        _and(chip, x, y);
-                        break;
-                    }
-                    case 3: {
-                        _xor(chip, x, y);
-                        break;
-                    }
-                    case 4: {
-                        add(chip, x, y);
-                        break;
-                    }
-                    case 5: {
-                        sub(chip, x, y);
-                        break;
-                    }
-                    case 6: {
-                        shr(chip, x);
-                        break;
-                    }
-                    case 7: { 
-                        subn(chip, x, y);
-                        break;
-                    }
-                    case 0xe: {
-                        shl(chip, x);
-                        break;
-                    }
-                    default: {
-                        perror("Invalid instruction\n"); 
-                        return;
-                    }
-                }
-                
-                break;
+            break;
+        }
+        case 0x1: {
+            unsigned short jump_addr = instruction & 0x0fff;
+            jmp(chip, jump_addr);
+            break;
+        }
+        case 0x2: {
+            unsigned short jump_addr = instruction & 0x0fff;
+            call(chip, jump_addr);
+            break;
+        }
+        case 0x3: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned char kk = instruction & 0x00ff;
+            iskip_on_equal(chip, x, kk);
+            break;
+        }
+        case 0x4: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned char kk = instruction & 0x00ff;
+            iskip_on_not_equal(chip, x, kk);
+            break;
+        }
+        case 0x5: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned short y = (instruction & 0x00f0) >> 4;
+            skip_on_equal(chip, x, y);
+            break;
+        }
+        case 0x6: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned char kk = instruction & 0x00ff;
+            iload(chip, x, kk);
+            break;
+        }
+        case 0x7: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned char kk = instruction & 0x00ff;
+            iadd(chip, x, kk);
+            break;
+        }
+        case 0x8: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned short y = (instruction & 0x00f0) >> 4;
+            switch(instruction & 0xf){
+                case 0: {
+                    assign(chip, x, y);
+                    break;
+                }
+                case 1: {
+                    _or(chip, x, y);
+                    break;
+                }
+                case 2: {
+                    _and(chip, x, y);
+                    break;
+                }
+                case 3: {
+                    _xor(chip, x, y);
+                    break;
+                }
+                case 4: {
+                    add(chip, x, y);
+                    break;
+                }
+                case 5: {
+                    sub(chip, x, y);
+                    break;
+                }
+                case 6: {
+                    shr(chip, x);
+                    break;
+                }
+                case 7: { 
+                    subn(chip, x, y);
+                    break;
+                }
+                case 0xe: {
+                    shl(chip, x);
+                    break;
+                }
+                default: {
+                    return -1;
+                }
             }
+            
+            break;
+        }
 
-            case 0x9: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned short y = (instruction & 0x00f0) >> 4;
-                skip_on_not_equal(chip, x, y);
-                break;
-            }
-            case 0xA: {
-                unsigned short nnn = instruction & 0x0fff;;
-                set_index(chip, nnn);
-                break;
-            }
-            case 0xB: {
-                unsigned short nnn = instruction & 0x0fff;;
-                jmp_rel(chip, nnn);
-                break;
-            }
-            case 0xC: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned char kk = instruction & 0x00ff;
-                set_rand(chip, x, kk);
-                break;
-            }
-            case 0xD: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                unsigned short y = (instruction & 0x00f0) >> 4;
-                unsigned short n = instruction & 0x000f;
-                display_sprite(chip, x, y, n);
-                break;
-            }
-            case 0xE: {
-                switch(instruction & 0xff){
-                    case 0x9e: {
-                        unsigned short x = (instruction & 0x0f00) >> 8;
-                        skip_pressed(chip, x);
-                        break;
-                    }
-                    case 0xa1: {
-                        unsigned short x = (instruction & 0x0f00) >> 8;
-                        skip_not_pressed(chip, x);
-                        break;
-                    }
-                    default: {
-                        perror("Invalid instruction\n"); 
-                        return;
-                    }
-                }
-                break;
+        case 0x9: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned short y = (instruction & 0x00f0) >> 4;
+            skip_on_not_equal(chip, x, y);
+            break;
+        }
+        case 0xA: {
+            unsigned short nnn = instruction & 0x0fff;;
+            set_index(chip, nnn);
+            break;
+        }
+        case 0xB: {
+            unsigned short nnn = instruction & 0x0fff;;
+            jmp_rel(chip, nnn);
+            break;
+        }
+        case 0xC: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned char kk = instruction & 0x00ff;
+            set_rand(chip, x, kk);
+            break;
+        }
+        case 0xD: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            unsigned short y = (instruction & 0x00f0) >> 4;
+            unsigned short n = instruction & 0x000f;
+            display_sprite(chip, x, y, n);
+            break;
+        }
+        case 0xE: {
+            switch(instruction & 0xff){
+                case 0x9e: {
+                    unsigned short x = (instruction & 0x0f00) >> 8;
+                    skip_pressed(chip, x);
+                    break;
+                }
+                case 0xa1: {
+                    unsigned short x = (instruction & 0x0f00) >> 8;
+                    skip_not_pressed(chip, x);
+                    break;
+                }
+                default: {
+                    return -1;
+                }
             }
-            case 0xF: {
-                unsigned short x = (instruction & 0x0f00) >> 8;
-                switch(instruction & 0xff){
-                    case 0x07: {
-                        load_delay(chip, x);
-                        break;
-                    }
-                    case 0x0a: {
-                        wait_for_key(chip, x);
-                        break;
-                    }
-                    case 0x15: {
-                        set_delay(chip, x);
-                        break;
-                    }
-                    case 0x18: {
-                        set_sound(chip, x);
-                        break;
-                    }
-                    case 0x1e: {
-                        add_to_index(chip, x);
-                        break;
-                    }
-                    case 0x29: {
-                        load_location(chip, x);
-                        break;
-                    }
-                    case 0x33: {
-                        store_bcd(chip, x);
-                        break;
-                    }
-                    case 0x55: {
-                        store_registers(chip, x);
-                        break;
-                    }
-                    case 0x65: {
-                        load_registers(chip, x);
-                    }
-                    default: {
-                        perror("Invalid instruction\n"); 
-                        return;
-                    }
-                }
-                break;
+            break;
+        }
+        case 0xF: {
+            unsigned short x = (instruction & 0x0f00) >> 8;
+            switch(instruction & 0xff){
+                case 0x07: {
+                    load_delay(chip, x);
+                    break;
+                }
+                case 0x0a: {
+                    wait_for_key(chip, x);
+                    return 1;
+                }
+                case 0x15: {
+                    set_delay(chip, x);
+                    break;
+                }
+                case 0x18: {
+                    set_sound(chip, x);
+                    break;
+                }
+                case 0x1e: {
+                    add_to_index(chip, x);
+                    break;
+                }
+                case 0x29: {
+                    load_location(chip, x);
+                    break;
+                }
+                case 0x33: {
+                    store_bcd(chip, x);
+                    break;
+                }
+                case 0x55: {
+                    store_registers(chip, x);
+                    break;
+                }
+                case 0x65: {
+                    load_registers(chip, x);
+                    break;
+                }
+                default: {
+                    return -1;
+                }
             }
+            break;
+        }
 
-            default: {
-                perror("Invalid instruction\n"); 
-                return;
-            }
+        default: {
+            return -1;
         }
     }
+    return 0;
 }
 
-int main(){
-    struct chip8 *chip = new_chip8();
-    load_rom(chip, "chip8-test-rom/test_opcode.ch8");
-    if(errno != EINVAL && errno != ENOMEM){
-        printf("Successfully loaded ROM in memory\n");
+#ifdef CHIP8_FUZZ
+/*
+    Edge coverage of the emulated program for the fuzzer, one counter per
+    pair of consecutive PCs, hashed into the table like AFL does. libFuzzer
+    reads counters in this section without being told about them.
+*/
+unsigned char chip8_edge_counters[CHIP8_EDGE_COUNTERS] __attribute__((section("__libfuzzer_extra_counters")));
+
+static inline void record_edge(unsigned short *previous, unsigned short pc){
+    chip8_edge_counters[(*previous * 0x9e37u ^ pc) % CHIP8_EDGE_COUNTERS]++;
+    *previous = pc;
+}
+
+/* Random bytes fault all the time, printing each fault would cost more than running them */
+#define report_fault(message)
+#else
+#define report_fault(message) perror(message)
+#endif
+
+/*
+    Main emulation loop. Instructions at even addresses are dispatched through
+    the decode cache, which is filled on first execution. Runs at most budget
+    instructions and returns how many were executed, or -1 on an invalid
+    instruction. Returns early when the ROM is detected to be idle.
+*/
+long decode(struct chip8 *chip, long budget){
+    long executed = 0;
+#ifdef CHIP8_FUZZ
+    unsigned short previous = 0;
+#endif
+
+    while(executed < budget){
+        /* Both bytes of the instruction must be addressable */
+        if(chip->pc >= 0x1000 - 1){
+            report_fault("Invalid memory address\n");
+            return -1;
+        }
+#ifdef CHIP8_FUZZ
+        record_edge(&previous, chip->pc);
+#endif
+#ifdef CHIP8_PROFILE
+        unsigned short pc = chip->pc;
+        unsigned char kind;
+        uint64_t started = profile_clock();
+#endif
+        executed++;
+        int status;
+        if(chip->pc & 1){
+#ifdef CHIP8_PROFILE
+            struct decoded_instruction odd;
+            predecode(&odd, fetch(chip));
+            kind = odd.op;
+#endif
+            status = execute(chip, fetch(chip));
+        }else{
+            struct decoded_instruction *d = &chip->decode_cache[chip->pc >> 1];
+            if(d->handler == NULL){
+                predecode_at(chip, d, chip->pc);
+            }
+#ifdef CHIP8_PROFILE
+            kind = d->op;
+#endif
+            if(!IS_FUSED_OP(d->op)){
+                status = d->handler(chip, d);
+            }else if(executed < budget){
+                executed++;
+                status = d->handler(chip, d);
+            }else{
+                /* One instruction of budget left, the pair is cut after its first half */
+                status = execute(chip, fetch(chip));
+            }
+        }
+#ifdef CHIP8_PROFILE
+        if(chip->profile != NULL){
+            profile_instruction(chip->profile, kind, pc, chip->pc, profile_clock() - started);
+        }
+#endif
+        if(status < 0){
+            report_fault("Invalid instruction\n");
+            return -1;
+        }
+        if(status > 0){
+            break;
+        }
     }
+    return executed;
+}
 
-    decode(chip);
-    free(chip);
-}
\ No newline at end of file
+/*
+    Runs one 60Hz frame: the key events since the last frame,
+    instructions_per_frame instructions, then a timer tick. A machine waiting on Fx0A only gets the
+    timer tick. The finished frame goes to chip->output if there is one.
+    Returns -1 if the core stopped on an error.
+*/
+int run_frame(struct chip8 *chip, core_fn core){
+    poll_keys(chip);
+    if(!chip->waiting_for_key && core(chip, chip->instructions_per_frame) < 0){
+        return -1;
+    }
+    tick_timers(chip);
+    if(chip->output != NULL){
+        publish_frame(chip->output, chip->display_memory, chip->dirty_rows);
+        chip->dirty_rows = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "cpu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reads the instruction at PC, which must be below 0xfff */
+static inline unsigned short fetch(const struct chip8 *chip){
+    return chip->memory[chip->pc] << 8 | chip->memory[chip->pc + 1];
+}
+
+/* Instructions executed between two 60Hz timer ticks, unless the machine is set otherwise */
+#define INSTRUCTIONS_PER_FRAME 10
+#define FRAME_NS (1000000000L / 60)
+
+/*
+    An interpreter core runs at most the given number of instructions and
+    returns how many it executed, or -1 if it stopped on an error
+*/
+typedef long (*core_fn)(struct chip8 *, long);
+
+#ifdef CHIP8_FUZZ
+/* Coverage counters filled by decode() in fuzzing builds */
+#define CHIP8_EDGE_COUNTERS (1 << 16)
+extern unsigned char chip8_edge_counters[CHIP8_EDGE_COUNTERS];
+#endif
+
+int execute(struct chip8 *, unsigned short);
+long decode(struct chip8 *, long);
+long decode_threaded(struct chip8 *, long);
+int run_frame(struct chip8 *, core_fn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "SDL.h"
+#include "cpu.h"
+#include "display.h"
+
+#define PIXEL_ON 0xffffffff
+#define PIXEL_OFF 0xff000000
+
+struct display{
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    /* Streaming texture with one ARGB8888 texel per CHIP-8 pixel */
+    SDL_Texture *texture;
+    /* Staging area for the rows being uploaded */
+    uint32_t pixels[DISPLAY_HEIGTH][DISPLAY_WIDTH];
+    /* Backspace is down */
+    int rewind_held;
+};
+
+/*
+    The usual layout, the left four columns of a QWERTY keyboard:
+    1 2 3 C     1 2 3 4
+    4 5 6 D     Q W E R
+    7 8 9 E     A S D F
+    A 0 B F     Z X C V
+*/
+static const SDL_Scancode keymap[16] = {
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V
+};
+
+struct display *new_display(int scale){
+    struct display *display = calloc(1, sizeof(struct display));
+    if(display == NULL){
+        perror("Display allocation failed");
+        return NULL;
+    }
+    if(SDL_Init(SDL_INIT_VIDEO) != 0){
+        fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+        free(display);
+        return NULL;
+    }
+    display->window = SDL_CreateWindow("Chip8", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+            DISPLAY_WIDTH * scale, DISPLAY_HEIGTH * scale, 0);
+    if(display->window != NULL){
+        display->renderer = SDL_CreateRenderer(display->window, -1, SDL_RENDERER_PRESENTVSYNC);
+    }
+    if(display->renderer != NULL){
+        display->texture = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_ARGB8888,
+                SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGTH);
+    }
+    if(display->texture == NULL){
+        fprintf(stderr, "Could not create the window: %s\n", SDL_GetError());
+        free_display(display);
+        return NULL;
+    }
+
+    /* The texture starts out undefined, everything after this is incremental */
+    uint64_t blank[DISPLAY_HEIGTH] = {0};
+    display_present(display, blank, 0xffffffff);
+    return display;
+}
+
+void free_display(struct display *display){
+    if(display->texture != NULL){
+        SDL_DestroyTexture(display->texture);
+    }
+    if(display->renderer != NULL){
+        SDL_DestroyRenderer(display->renderer);
+    }
+    if(display->window != NULL){
+        SDL_DestroyWindow(display->window);
+    }
+    SDL_Quit();
+    free(display);
+}
+
+/* Feeds keyboard events to the machine. Returns -1 once the window is closed. */
+int display_poll_events(struct display *display, struct chip8 *chip){
+    SDL_Event event;
+
+    while(SDL_PollEvent(&event)){
+        if(event.type == SDL_QUIT){
+            return -1;
+        }
+        if((event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) || event.key.repeat){
+            continue;
+        }
+        if(event.key.keysym.scancode == SDL_SCANCODE_BACKSPACE){
+            display->rewind_held = event.type == SDL_KEYDOWN;
+        }
+        for(unsigned char key = 0; key < 16; key++){
+            if(keymap[key] == event.key.keysym.scancode){
+                key_event(chip, key, event.type == SDL_KEYDOWN);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Whether the rewind key is held, as of the last display_poll_events */
+int display_rewind_held(const struct display *display){
+    return display->rewind_held;
+}
+
+/*
+    Uploads the rows whose bit is set in dirty, one SDL_UpdateTexture per run
+    of adjacent dirty rows, and presents the frame. Clean rows keep whatever
+    the texture already holds, rows may be NULL when dirty is 0.
+*/
+void display_present(struct display *display, const uint64_t *rows, uint32_t dirty){
+    uint32_t (*pixels)[DISPLAY_WIDTH] = display->pixels;
+
+    while(dirty != 0){
+        int first = __builtin_ctz(dirty);
+        int last = first;
+        while(last + 1 < DISPLAY_HEIGTH && (dirty >> (last + 1)) & 1){
+            last++;
+        }
+
+        for(int y = first; y <= last; y++){
+            uint64_t row = rows[y];
+            for(int x = 0; x < DISPLAY_WIDTH; x++){
+                pixels[y][x] = (row >> (DISPLAY_WIDTH - 1 - x)) & 1 ? PIXEL_ON : PIXEL_OFF;
+            }
+        }
+        SDL_Rect rect = {0, first, DISPLAY_WIDTH, last - first + 1};
+        SDL_UpdateTexture(display->texture, &rect, pixels[first], sizeof(display->pixels[0]));
+
+        /* Bit 31 is handled separately, shifting a 32 bit value by 32 is undefined */
+        dirty = last == DISPLAY_HEIGTH - 1 ? 0 : dirty & ~((2u << last) - 1);
+    }
+
+    SDL_RenderClear(display->renderer);
+    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+    SDL_RenderPresent(display->renderer);
+}
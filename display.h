@@ -0,0 +1,19 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdint.h>
+
+struct chip8;
+struct display;
+
+/*
+    SDL window showing the framebuffer, scaled up by an integer factor.
+    Only built when SDL is available (make SDL=1).
+*/
+struct display *new_display(int);
+void free_display(struct display *);
+int display_poll_events(struct display *, struct chip8 *);
+int display_rewind_held(const struct display *);
+void display_present(struct display *, const uint64_t *, uint32_t);
+
+#endif
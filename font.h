@@ -2,7 +2,9 @@
 #ifndef FONTSET_SIZE
 #define FONTSET_SIZE 80
 
-uint8_t fontset[FONTSET_SIZE] =
+#include <stdint.h>
+
+static const uint8_t fontset[FONTSET_SIZE] =
 {
 	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 	0x20, 0x60, 0x20, 0x20, 0x70, // 1
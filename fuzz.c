@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "savestate.h"
+#include "batch.h"
+#include "hash.h"
+#include "vec_env.h"
+
+/*
+    Fuzzing harness for decode() and the instruction handlers.
+
+    An input is a key script followed by a ROM: one byte with the number of
+    frames the script covers, two bytes of held keys per frame (low byte
+    first), and the ROM in whatever is left. The script repeats if the run
+    is longer. Every input runs for at most FUZZ_FRAMES frames on the same
+    machine, put back in its reset state from a savestate between inputs.
+
+    Built with libFuzzer (make chip8-libfuzzer, needs clang) the coverage
+    is the host code plus chip8_edge_counters, the edges between emulated
+    PCs. The standalone build (make chip8-fuzz) runs with AddressSanitizer
+    and UndefinedBehaviorSanitizer under gcc:
+    chip8-fuzz file...      runs the given inputs, such as crash reproducers
+    chip8-fuzz -n runs [-s seed] [-b]
+                            runs random inputs and reports the edges found,
+                            an input that crashes is saved to crash.bin.
+                            With -b every input also runs on the batch
+                            engine, which has to end in the state decode()
+                            ends in, and in a vectorized environment that
+                            is stepped frame by frame, reset and run again,
+                            which has to show what decode() shows. An input
+                            that disagrees is saved as a crash.
+*/
+
+#define START_ADDRESS 0x200
+
+#ifndef FUZZ_FRAMES
+#define FUZZ_FRAMES 64
+#endif
+
+static struct chip8 *chip;
+/* The reset machine, and the state the next input is built in */
+static unsigned char pristine[CHIP8_STATE_SIZE];
+static unsigned char scratch[CHIP8_STATE_SIZE];
+/* The lane the batch engine is checked in with -b, and a machine to copy it out to */
+static struct chip8_batch *batch;
+static struct chip8 *lane;
+/* Where the scalar runs behind the environment check are made */
+static struct chip8 *reference;
+
+static void setup(void){
+    chip = new_chip8();
+    /* Reproducers must behave the same every time */
+    seed_chip8(chip, 0);
+    memcpy(pristine, chip, CHIP8_STATE_SIZE);
+}
+
+/* Aborts unless the lane ended where decode() did, faulted counting as an end */
+static void check_batch(int faulted){
+    if(faulted){
+        if(batch->status[0] != LANE_FAULTED){
+            fprintf(stderr, "decode() faulted at pc 0x%03x and the batch did not\n", chip->pc);
+            abort();
+        }
+        return;
+    }
+    batch_get_lane(batch, 0, lane);
+    if(batch->status[0] != LANE_RUNNING || hash_state(lane) != hash_state(chip)){
+        fprintf(stderr, "The batch ended at pc 0x%03x, decode() at pc 0x%03x\n", lane->pc, chip->pc);
+        abort();
+    }
+}
+
+/*
+    Runs the key script on a one environment chip8_vec_env and on decode(),
+    a frame per step, twice with a reset in between: the observation, the
+    done flag and the reward, the growth of the byte at 0, have to agree.
+    The environment seeds episode e of its only machine with e.
+*/
+static void check_env(const uint8_t *rom, size_t rom_size, const uint8_t *keys, size_t frames){
+    uint64_t observation[DISPLAY_HEIGTH];
+    float reward;
+    unsigned char done;
+    struct chip8_vec_env_buffers buffers = {observation, &reward, &done};
+    struct chip8_reward term = {0, 1};
+    struct chip8_vec_env *env = new_chip8_vec_env(rom, rom_size, 1, 0, &term, 1, &buffers);
+    if(env == NULL){
+        abort();
+    }
+
+    for(unsigned int episode = 0; episode < 2; episode++){
+        if(episode > 0){
+            chip8_vec_env_reset(env, NULL);
+        }
+        chip8_load_state_bytes(reference, scratch);
+        seed_chip8(reference, episode);
+        unsigned char start = reference->memory[0];
+        float total = 0;
+        unsigned short previous = 0;
+        int faulted = 0;
+
+        for(int frame = 0; frame < FUZZ_FRAMES; frame++){
+            unsigned short held = 0;
+            if(frames > 0){
+                const uint8_t *mask = keys + 2 * (frame % frames);
+                held = mask[0] | mask[1] << 8;
+            }
+            uint16_t action = held;
+            set_keypad(reference, held, held & ~previous);
+            previous = held;
+            chip8_vec_env_step(env, &action, 1);
+            total += reward;
+            if(!faulted && run_frame(reference, decode) != 0){
+                faulted = 1;
+            }
+            if(done != faulted || (!faulted && memcmp(observation, reference->display_memory, sizeof(observation)) != 0)){
+                fprintf(stderr, "Episode %u of the environment differs from decode() at frame %d\n", episode, frame);
+                abort();
+            }
+        }
+        if(!faulted && total != reference->memory[0] - start){
+            fprintf(stderr, "Episode %u of the environment was rewarded %g, not %d\n",
+                    episode, total, reference->memory[0] - start);
+            abort();
+        }
+    }
+    free_chip8_vec_env(env);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    if(chip == NULL){
+        setup();
+    }
+    if(size < 1){
+        return 0;
+    }
+    size_t frames = data[0];
+    size_t script = 1 + 2 * frames;
+    if(script > size){
+        frames = (size - 1) / 2;
+        script = 1 + 2 * frames;
+    }
+    const uint8_t *keys = data + 1;
+    const uint8_t *rom = data + script;
+    size_t rom_size = size - script;
+    if(rom_size > sizeof(chip->memory) - START_ADDRESS){
+        rom_size = sizeof(chip->memory) - START_ADDRESS;
+    }
+
+    /* Only the decode cache entries of the bytes that differ from the last input are dropped */
+    memcpy(scratch, pristine, CHIP8_STATE_SIZE);
+    memcpy(scratch + offsetof(struct chip8, memory) + START_ADDRESS, rom, rom_size);
+    chip8_load_state_bytes(chip, scratch);
+    if(batch != NULL){
+        batch_set_lane(batch, 0, chip);
+    }
+
+    unsigned short previous = 0;
+    int faulted = 0;
+    for(int frame = 0; frame < FUZZ_FRAMES; frame++){
+        unsigned short held = 0;
+        if(frames > 0){
+            const uint8_t *mask = keys + 2 * (frame % frames);
+            held = mask[0] | mask[1] << 8;
+        }
+        if(batch != NULL){
+            /* The batch only knows held keys, a press is a key that went down */
+            set_keypad(chip, held, held & ~previous);
+            previous = held;
+            for(int key = 0; key < 16; key++){
+                batch->keys[key * batch->stride] = (held >> key) & 1;
+            }
+            batch_run_frame(batch);
+        }else{
+            /* Every held key counts as pressed, so Fx0A always has a way out */
+            set_keypad(chip, held, held);
+        }
+        if(run_frame(chip, decode) != 0){
+            faulted = 1;
+            break;
+        }
+    }
+    if(batch != NULL){
+        check_batch(faulted);
+        check_env(rom, rom_size, keys, frames);
+    }
+    return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+#include <fcntl.h>
+#include <signal.h>
+
+/* Both sanitizers abort on the first error, so that save_crash gets to run */
+const char *__asan_default_options(void){
+    return "abort_on_error=1";
+}
+
+const char *__ubsan_default_options(void){
+    return "abort_on_error=1:print_stacktrace=1";
+}
+
+/* The random input being run, written out if a sanitizer stops the process */
+static unsigned char input[1 + 2 * 8 + 256];
+static size_t input_size;
+
+static void save_crash(int signal){
+    int fd = open("crash.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0){
+        if(write(fd, input, input_size) == (ssize_t)input_size){
+            static const char message[] = "The input is in crash.bin\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+        }
+        close(fd);
+    }
+}
+
+static int run_file(const char *path){
+    FILE *fd = fopen(path, "rb");
+    if(fd == NULL){
+        perror(path);
+        return -1;
+    }
+    fseek(fd, 0, SEEK_END);
+    long length = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    unsigned char *data = malloc(length > 0 ? length : 1);
+    size_t size = fread(data, 1, length > 0 ? length : 0, fd);
+    fclose(fd);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    long runs = 0;
+    unsigned int seed = 1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:s:b")) != -1){
+        switch(opt){
+            case 'n': {
+                runs = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 's': {
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            }
+            case 'b': {
+                setup();
+                batch = new_chip8_batch(1, chip);
+                lane = new_chip8();
+                reference = new_chip8();
+                if(batch == NULL || lane == NULL || reference == NULL){
+                    return 1;
+                }
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: %s [-n runs] [-s seed] [-b] [file...]\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    for(int i = optind; i < argc; i++){
+        if(run_file(argv[i]) < 0){
+            return 1;
+        }
+    }
+    if(runs <= 0){
+        return 0;
+    }
+
+    /* Random inputs of a short script and up to 256 bytes of ROM */
+    signal(SIGABRT, save_crash);
+    unsigned int state = rng_state_for_seed(seed);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long run = 0; run < runs; run++){
+        size_t size = 1 + 2 * 8 + 16 + state % 240;
+        input_size = size;
+        for(size_t i = 0; i < size; i++){
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            input[i] = state >> 24;
+        }
+        input[0] %= 9;
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    long edges = 0;
+    for(size_t i = 0; i < CHIP8_EDGE_COUNTERS; i++){
+        edges += chip8_edge_counters[i] != 0;
+    }
+    printf("%ld runs, %.0f runs/s, %ld edges\n", runs, runs / seconds, edges);
+    return 0;
+}
+#endif
@@ -0,0 +1,42 @@
+#include "cpu.h"
+#include "hash.h"
+
+#define FNV_PRIME 0x100000001b3ull
+
+/* 64 bit FNV-1a, continuing from hash so that several buffers can be chained */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size){
+    const unsigned char *bytes = data;
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+    Hashes everything a program can observe: registers, memory, stack,
+    timers, keys, the framebuffer and the random generator. Caches and
+    host side state are left out, so equal machines hash equal whatever
+    core ran them.
+*/
+uint64_t hash_state(const struct chip8 *chip){
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = fnv1a(hash, chip->registers, sizeof(chip->registers));
+    hash = fnv1a(hash, chip->memory, sizeof(chip->memory));
+    hash = fnv1a(hash, &chip->index_register, sizeof(chip->index_register));
+    hash = fnv1a(hash, &chip->pc, sizeof(chip->pc));
+    hash = fnv1a(hash, chip->stack, sizeof(chip->stack));
+    hash = fnv1a(hash, &chip->sp, sizeof(chip->sp));
+    hash = fnv1a(hash, &chip->delay_timer, sizeof(chip->delay_timer));
+    hash = fnv1a(hash, &chip->sound_timer, sizeof(chip->sound_timer));
+    hash = fnv1a(hash, chip->keys, sizeof(chip->keys));
+    hash = fnv1a(hash, &chip->waiting_for_key, sizeof(chip->waiting_for_key));
+    hash = fnv1a(hash, &chip->key_register, sizeof(chip->key_register));
+    hash = fnv1a(hash, chip->display_memory, sizeof(chip->display_memory));
+    hash = fnv1a(hash, &chip->rng_state, sizeof(chip->rng_state));
+    return hash;
+}
+
+uint64_t hash_framebuffer(const struct chip8 *chip){
+    return fnv1a(FNV_OFFSET_BASIS, chip->display_memory, sizeof(chip->display_memory));
+}
@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct chip8;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+
+uint64_t fnv1a(uint64_t, const void *, size_t);
+uint64_t hash_state(const struct chip8 *);
+uint64_t hash_framebuffer(const struct chip8 *);
+
+#endif
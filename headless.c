@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include "headless.h"
+#include "hash.h"
+
+static const char *const exit_names[] = {
+    [HEADLESS_BUDGET] = "budget",
+    [HEADLESS_PC] = "pc",
+    [HEADLESS_CONDITION] = "condition",
+    [HEADLESS_HALT] = "halt",
+    [HEADLESS_FAULT] = "fault",
+};
+
+/*
+    Whether nothing but the timers can change any more: the ROM jumps to
+    itself, or waits for a key and there is nobody to press one
+*/
+static int halted(const struct chip8 *chip){
+    if(chip->waiting_for_key){
+        return 1;
+    }
+    return chip->pc < 0x1000 - 1 && fetch(chip) == (0x1000 | chip->pc);
+}
+
+/*
+    Runs up to budget instructions one at a time, stopping in front of
+    exit_pc. Returns how many ran, or -1 on a fault.
+*/
+static long step_to(struct chip8 *chip, core_fn core, long budget, int exit_pc){
+    long executed = 0;
+    while(executed < budget && chip->pc != exit_pc){
+        long done = core(chip, 1);
+        if(done < 0){
+            return -1;
+        }
+        executed += done;
+    }
+    return executed;
+}
+
+/* A P4 bitmap, the rows are already one bit per pixel with the leftmost pixel first */
+static int write_pbm(const struct chip8 *chip, const char *path){
+    FILE *fd = fopen(path, "wb");
+    if(fd == NULL){
+        perror("Error opening the framebuffer file");
+        return -1;
+    }
+    fprintf(fd, "P4\n%d %d\n", DISPLAY_WIDTH, DISPLAY_HEIGTH);
+    for(int y = 0; y < DISPLAY_HEIGTH; y++){
+        unsigned char row[DISPLAY_WIDTH / 8];
+        for(int i = 0; i < DISPLAY_WIDTH / 8; i++){
+            row[i] = chip->display_memory[y] >> (56 - 8 * i);
+        }
+        fwrite(row, sizeof(row), 1, fd);
+    }
+    int status = ferror(fd) ? -1 : 0;
+    if(fclose(fd) != 0 || status < 0){
+        perror("Error writing the framebuffer");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Runs the machine frame by frame without any input, sleeping or window,
+    then prints why it stopped, how far it got and the hashes of the state
+    and of the framebuffer. A frame an idle loop cuts short still counts
+    all its instructions, the ones the loop would have spent spinning.
+    The exit PC is checked before every instruction, which steps the core
+    one instruction at a time. The exit condition is checked once a frame.
+
+    Returns 0 if the run stopped where it was asked to, or used up its
+    budget when nothing else was asked for, 2 if an exit condition was
+    given and never happened, and 1 on a fault.
+*/
+int run_headless(struct chip8 *chip, core_fn core, const struct headless_run *run){
+    enum headless_exit reason = HEADLESS_BUDGET;
+    long frames = 0;
+    long cycles = 0;
+
+    while((run->frames <= 0 || frames < run->frames) && (run->cycles <= 0 || cycles < run->cycles)){
+        long slice = chip->instructions_per_frame;
+        if(run->cycles > 0 && run->cycles - cycles < slice){
+            slice = run->cycles - cycles;
+        }
+
+        long executed = slice;
+        if(!chip->waiting_for_key){
+            executed = run->exit_pc >= 0 ? step_to(chip, core, slice, run->exit_pc) : core(chip, slice);
+        }
+        if(executed < 0){
+            reason = HEADLESS_FAULT;
+            break;
+        }
+        if(run->exit_pc >= 0 && chip->pc == run->exit_pc){
+            cycles += executed;
+            reason = HEADLESS_PC;
+            break;
+        }
+        cycles += slice;
+        tick_timers(chip);
+        frames++;
+
+        if(condition_met(&run->exit_condition, chip)){
+            reason = HEADLESS_CONDITION;
+            break;
+        }
+        if(halted(chip)){
+            reason = HEADLESS_HALT;
+            break;
+        }
+    }
+
+    printf("exit: %s\n", exit_names[reason]);
+    printf("frames: %ld\n", frames);
+    printf("cycles: %ld\n", cycles);
+    printf("pc: 0x%03x\n", chip->pc);
+    printf("state: %016llx\n", (unsigned long long)hash_state(chip));
+    printf("framebuffer: %016llx\n", (unsigned long long)hash_framebuffer(chip));
+    if(run->framebuffer != NULL && write_pbm(chip, run->framebuffer) < 0){
+        return 1;
+    }
+
+    switch(reason){
+        case HEADLESS_FAULT: {
+            return 1;
+        }
+        case HEADLESS_PC:
+        case HEADLESS_CONDITION: {
+            return 0;
+        }
+        default: {
+            return run->exit_pc >= 0 || run->exit_condition.set ? 2 : 0;
+        }
+    }
+}
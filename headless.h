@@ -0,0 +1,36 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "cpu.h"
+#include "decoder.h"
+#include "condition.h"
+
+/*
+    A run with no display and no pacing, as fast as the core goes, until
+    one of the limits or exit conditions is reached. 0 and unset fields
+    do not limit the run.
+*/
+struct headless_run{
+    /* Instructions and 60Hz frames, whichever runs out first */
+    long cycles;
+    long frames;
+    /* Stops before executing the instruction at this address, -1 for none */
+    int exit_pc;
+    /* Stops at the end of the first frame that meets it */
+    struct condition exit_condition;
+    /* Where the final framebuffer goes as a PBM image, or NULL */
+    const char *framebuffer;
+};
+
+enum headless_exit{
+    HEADLESS_BUDGET,
+    HEADLESS_PC,
+    HEADLESS_CONDITION,
+    /* The ROM jumps to itself and nothing can change any more */
+    HEADLESS_HALT,
+    HEADLESS_FAULT
+};
+
+int run_headless(struct chip8 *, core_fn, const struct headless_run *);
+
+#endif
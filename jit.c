@@ -0,0 +1,1025 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_OPERANDS_SIZE 4096
+#define JIT_MAX_BLOCK_LENGTH 64
+/* Largest amount of code emitted for a single instruction, with its exits */
+#define JIT_MAX_INSTRUCTION_SIZE 512
+
+/* Host registers, numbered the way ModRM and REX encode them */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/*
+    Host registers the V registers of a block live in. r12 to r15 survive
+    the fallback calls, the others are reloaded after each one. rax and rcx
+    are scratch, rbx holds the machine and ebp the budget.
+*/
+static const unsigned char pin_registers[] = {R12, R13, R14, R15, RDX, RSI, RDI, R8, R9, R10, R11};
+#define PIN_COUNT (sizeof(pin_registers) / sizeof(pin_registers[0]))
+
+/*
+    A compiled block runs at most budget instructions, budget being at least
+    1, and returns the number it executed. It goes on into the block at the
+    address it ends on when there is one, without coming back to decode_jit.
+*/
+typedef int (*jit_block)(struct chip8 *, int budget);
+
+struct jit{
+    unsigned char *code;
+    size_t code_used;
+    /* Private copies of the operands passed to the fallback handlers */
+    struct decoded_instruction operands[JIT_OPERANDS_SIZE];
+    size_t operands_used;
+    /* Compiled blocks, keyed by the (even) address they start at */
+    jit_block blocks[DECODE_CACHE_SIZE];
+    /* Where other blocks jump into them, past the prologue */
+    unsigned char *bodies[DECODE_CACHE_SIZE];
+    /* Even addresses that are part of at least one compiled block */
+    unsigned char covered[DECODE_CACHE_SIZE];
+    /* Set when compiled code was written over, handled between blocks */
+    int flush_pending;
+};
+
+/* Where the V registers of the block being compiled are */
+struct allocation{
+    /* Host register of each V register, -1 for the ones left in memory */
+    signed char host[16];
+    /* V registers in a host register */
+    unsigned short pinned;
+    /* Pinned registers written since they were last stored */
+    unsigned short dirty;
+};
+
+struct jit *new_jit(){
+    struct jit *jit = (struct jit*)calloc(1, sizeof(struct jit));
+    if(jit == NULL){
+        return NULL;
+    }
+    /* Never writable and executable at once, compile_block() switches between the two */
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED){
+        perror("Could not map memory for the JIT");
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void free_jit(struct jit *jit){
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+void jit_flush(struct jit *jit){
+    jit->code_used = 0;
+    jit->operands_used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->bodies, 0, sizeof(jit->bodies));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->flush_pending = 0;
+}
+
+/*
+    Called for every memory write that may hit code. The flush is deferred,
+    since the write may come from the block that is currently running.
+*/
+void jit_invalidate(struct jit *jit, unsigned short address){
+    if(jit->covered[(address & 0xfff) >> 1]){
+        jit->flush_pending = 1;
+    }
+}
+
+static void emit8(struct jit *jit, unsigned char byte){
+    jit->code[jit->code_used++] = byte;
+}
+
+static void emit16(struct jit *jit, unsigned short value){
+    memcpy(jit->code + jit->code_used, &value, 2);
+    jit->code_used += 2;
+}
+
+static void emit32(struct jit *jit, unsigned int value){
+    memcpy(jit->code + jit->code_used, &value, 4);
+    jit->code_used += 4;
+}
+
+static void emit64(struct jit *jit, unsigned long value){
+    memcpy(jit->code + jit->code_used, &value, 8);
+    jit->code_used += 8;
+}
+
+/* A jump with an 8 bit displacement, returns where to patch it */
+static size_t emit_jump8(struct jit *jit, unsigned char opcode){
+    emit8(jit, opcode);
+    return jit->code_used++;
+}
+
+/* Points a jump emitted by emit_jump8() at the current position */
+static void patch_jump8(struct jit *jit, size_t displacement){
+    jit->code[displacement] = jit->code_used - displacement - 1;
+}
+
+/* ModRM and displacement for [rbx + offset], with reg as the register field */
+static void emit_chip_operand(struct jit *jit, unsigned char reg, size_t offset){
+    emit8(jit, 0x80 | (reg << 3) | 3);
+    emit32(jit, (unsigned int)offset);
+}
+
+#define V_OFFSET(x) (offsetof(struct chip8, registers) + (x))
+#define PC_OFFSET offsetof(struct chip8, pc)
+#define INDEX_OFFSET offsetof(struct chip8, index_register)
+#define DELAY_OFFSET offsetof(struct chip8, delay_timer)
+#define SOUND_OFFSET offsetof(struct chip8, sound_timer)
+#define RNG_OFFSET offsetof(struct chip8, rng_state)
+
+/* The V registers start struct chip8, so [rbx + x] fits an 8 bit displacement */
+_Static_assert(V_OFFSET(0xf) < 0x80, "the V registers must be at the start of struct chip8");
+
+/*
+    Byte operations always carry a REX prefix, so that registers 4 to 7 are
+    spl, bpl, sil and dil rather than ah, ch, dh and bh
+*/
+static void emit_rex(struct jit *jit, unsigned char reg, unsigned char rm){
+    emit8(jit, 0x40 | (reg >> 3) << 2 | (rm >> 3));
+}
+
+/* opcode r/m8, r8 between two host registers, rm is the destination for the ALU opcodes */
+static void emit_byte_registers(struct jit *jit, unsigned char opcode, unsigned char reg, unsigned char rm){
+    emit_rex(jit, reg, rm);
+    emit8(jit, opcode);
+    emit8(jit, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* opcode between a host register and [rbx + x], the V register in memory */
+static void emit_byte_memory(struct jit *jit, unsigned char opcode, unsigned char reg, unsigned char x){
+    emit_rex(jit, reg, 0);
+    emit8(jit, opcode);
+    emit8(jit, 0x40 | (reg & 7) << 3 | RBX);
+    emit8(jit, V_OFFSET(x));
+}
+
+/* 80 /digit: add, or, and, sub, xor or cmp of a host byte register with kk */
+static void emit_byte_immediate(struct jit *jit, unsigned char digit, unsigned char rm, unsigned char kk){
+    emit_rex(jit, 0, rm);
+    emit8(jit, 0x80);
+    emit8(jit, 0xc0 | digit << 3 | (rm & 7));
+    emit8(jit, kk);
+}
+
+/* setcc of a host byte register */
+static void emit_setcc(struct jit *jit, unsigned char opcode, unsigned char rm){
+    emit_rex(jit, 0, rm);
+    emit8(jit, 0x0f);
+    emit8(jit, opcode);
+    emit8(jit, 0xc0 | (rm & 7));
+}
+
+#define OPCODE_ADD 0x00
+#define OPCODE_OR 0x08
+#define OPCODE_AND 0x20
+#define OPCODE_SUB 0x28
+#define OPCODE_XOR 0x30
+#define OPCODE_CMP 0x38
+#define OPCODE_STORE 0x88
+#define OPCODE_LOAD 0x8a
+#define DIGIT_ADD 0
+#define DIGIT_AND 4
+#define SETAE 0x93
+#define SETC 0x92
+
+static int pinned(const struct allocation *a, unsigned char x){
+    return a->host[x] >= 0;
+}
+
+/* Copies V register x into the scratch register tmp */
+static void emit_load_v(struct jit *jit, const struct allocation *a, unsigned char tmp, unsigned char x){
+    if(a->host[x] >= 0){
+        emit_byte_registers(jit, OPCODE_STORE, a->host[x], tmp);
+    }else{
+        emit_byte_memory(jit, OPCODE_LOAD, tmp, x);
+    }
+}
+
+/* Copies the scratch register tmp into V register x */
+static void emit_store_v(struct jit *jit, struct allocation *a, unsigned char x, unsigned char tmp){
+    if(a->host[x] >= 0){
+        emit_byte_registers(jit, OPCODE_STORE, tmp, a->host[x]);
+        a->dirty |= 1 << x;
+    }else{
+        emit_byte_memory(jit, OPCODE_STORE, tmp, x);
+    }
+}
+
+/* Vx = kk */
+static void emit_set_v(struct jit *jit, struct allocation *a, unsigned char x, unsigned char kk){
+    if(a->host[x] >= 0){
+        /* mov r8, kk */
+        emit_rex(jit, 0, a->host[x]);
+        emit8(jit, 0xb0 | (a->host[x] & 7));
+        a->dirty |= 1 << x;
+    }else{
+        /* mov byte [rbx + x], kk */
+        emit8(jit, 0xc6);
+        emit8(jit, 0x40 | RBX);
+        emit8(jit, V_OFFSET(x));
+    }
+    emit8(jit, kk);
+}
+
+/* Vx op= Vy, for the ALU opcodes and mov */
+static void emit_v_operation(struct jit *jit, struct allocation *a, unsigned char opcode, unsigned char x, unsigned char y){
+    unsigned char source = a->host[y] >= 0 ? a->host[y] : RAX;
+    if(a->host[y] < 0){
+        emit_byte_memory(jit, OPCODE_LOAD, RAX, y);
+    }
+    if(a->host[x] >= 0){
+        emit_byte_registers(jit, opcode, source, a->host[x]);
+        a->dirty |= 1 << x;
+    }else{
+        emit_byte_memory(jit, opcode, source, x);
+    }
+}
+
+/* Stores the pinned registers that changed, the block goes on with them pinned */
+static void emit_write_back(struct jit *jit, const struct allocation *a){
+    for(int x = 0; x < 16; x++){
+        if(a->dirty & (1 << x)){
+            emit_byte_memory(jit, OPCODE_STORE, a->host[x], x);
+        }
+    }
+}
+
+/* Loads every pinned register from the machine */
+static void emit_reload(struct jit *jit, struct allocation *a){
+    for(int x = 0; x < 16; x++){
+        if(a->pinned & (1 << x)){
+            emit_byte_memory(jit, OPCODE_LOAD, a->host[x], x);
+        }
+    }
+    a->dirty = 0;
+}
+
+/* mov word [rbx + pc], value */
+static void emit_set_pc(struct jit *jit, unsigned short value){
+    emit8(jit, 0x66);
+    emit8(jit, 0xc7);
+    emit_chip_operand(jit, 0, PC_OFFSET);
+    emit16(jit, value);
+}
+
+/*
+    push rbx; push rbp; push r12 to r15; sub rsp, 8; mov rbx, rdi;
+    mov ebp, esi; mov [rsp], esi. The budget the block started with stays
+    at [rsp], and the stack is 16 byte aligned for the fallback calls.
+*/
+static void emit_prologue(struct jit *jit){
+    emit8(jit, 0x53);
+    emit8(jit, 0x55);
+    for(int r = R12; r <= R15; r++){
+        emit8(jit, 0x41);
+        emit8(jit, 0x50 | (r & 7));
+    }
+    emit8(jit, 0x48);
+    emit8(jit, 0x83);
+    emit8(jit, 0xec);
+    emit8(jit, 0x08);
+    emit8(jit, 0x48);
+    emit8(jit, 0x89);
+    emit8(jit, 0xfb);
+    emit8(jit, 0x89);
+    emit8(jit, 0xf5);
+    emit8(jit, 0x89);
+    emit8(jit, 0x34);
+    emit8(jit, 0x24);
+}
+
+/*
+    Returns the number of instructions executed, the starting budget less
+    the one left: mov eax, [rsp]; sub eax, ebp; add rsp, 8; pop r15 to r12;
+    pop rbp; pop rbx; ret
+*/
+static void emit_epilogue(struct jit *jit){
+    emit8(jit, 0x8b);
+    emit8(jit, 0x04);
+    emit8(jit, 0x24);
+    emit8(jit, 0x29);
+    emit8(jit, 0xe8);
+    emit8(jit, 0x48);
+    emit8(jit, 0x83);
+    emit8(jit, 0xc4);
+    emit8(jit, 0x08);
+    for(int r = R15; r >= R12; r--){
+        emit8(jit, 0x41);
+        emit8(jit, 0x58 | (r & 7));
+    }
+    emit8(jit, 0x5d);
+    emit8(jit, 0x5b);
+    emit8(jit, 0xc3);
+}
+
+/*
+    Leaves the block with the V registers stored and the PC set. Jumps
+    straight into the block at the PC if there is one and no flush is
+    pending, otherwise returns to decode_jit().
+*/
+static void emit_chain(struct jit *jit){
+    size_t leave[4];
+    /* movzx eax, word [rbx + pc]; test al, 1; jnz leave */
+    emit8(jit, 0x0f);
+    emit8(jit, 0xb7);
+    emit_chip_operand(jit, RAX, PC_OFFSET);
+    emit8(jit, 0xa8);
+    emit8(jit, 0x01);
+    leave[0] = emit_jump8(jit, 0x75);
+    /* cmp eax, 0xffe; ja leave */
+    emit8(jit, 0x3d);
+    emit32(jit, 0x1000 - 2);
+    leave[1] = emit_jump8(jit, 0x77);
+    /* mov rcx, bodies; mov rax, [rcx + rax * 4]; test rax, rax; jz leave */
+    emit8(jit, 0x48);
+    emit8(jit, 0xb9);
+    emit64(jit, (unsigned long)jit->bodies);
+    emit8(jit, 0x48);
+    emit8(jit, 0x8b);
+    emit8(jit, 0x04);
+    emit8(jit, 0x81);
+    emit8(jit, 0x48);
+    emit8(jit, 0x85);
+    emit8(jit, 0xc0);
+    leave[2] = emit_jump8(jit, 0x74);
+    /* mov rcx, &flush_pending; cmp dword [rcx], 0; jne leave; jmp rax */
+    emit8(jit, 0x48);
+    emit8(jit, 0xb9);
+    emit64(jit, (unsigned long)&jit->flush_pending);
+    emit8(jit, 0x83);
+    emit8(jit, 0x39);
+    emit8(jit, 0x00);
+    leave[3] = emit_jump8(jit, 0x75);
+    emit8(jit, 0xff);
+    emit8(jit, 0xe0);
+    for(int i = 0; i < 4; i++){
+        patch_jump8(jit, leave[i]);
+    }
+    emit_epilogue(jit);
+}
+
+/* Leaves the block for a PC known at compile time */
+static void emit_exit(struct jit *jit, const struct allocation *a, unsigned short pc){
+    emit_write_back(jit, a);
+    emit_set_pc(jit, pc);
+    emit_chain(jit);
+}
+
+/*
+    Emitted in front of every instruction of the checked copy of a block:
+    takes one instruction off ebp, the budget, or stops the block before
+    the instruction at address if there is none left
+*/
+static void emit_budget_check(struct jit *jit, const struct allocation *a, unsigned short address){
+    /* dec ebp; jns over the exit; inc ebp */
+    emit8(jit, 0xff);
+    emit8(jit, 0xcd);
+    size_t over = emit_jump8(jit, 0x79);
+    emit8(jit, 0xff);
+    emit8(jit, 0xc5);
+    emit_write_back(jit, a);
+    emit_set_pc(jit, address);
+    emit_epilogue(jit);
+    patch_jump8(jit, over);
+}
+
+/*
+    Calls the decode cache handler of an instruction with a private copy of
+    its operands. The handler sees the V registers in the machine.
+*/
+static void emit_fallback(struct jit *jit, struct allocation *a, const struct decoded_instruction *d,
+        unsigned short address){
+    struct decoded_instruction *copy = &jit->operands[jit->operands_used++];
+    *copy = *d;
+    emit_write_back(jit, a);
+    emit_set_pc(jit, address);
+    /* mov rdi, rbx */
+    emit8(jit, 0x48);
+    emit8(jit, 0x89);
+    emit8(jit, 0xdf);
+    /* mov rsi, copy */
+    emit8(jit, 0x48);
+    emit8(jit, 0xbe);
+    emit64(jit, (unsigned long)copy);
+    /* mov rax, handler; call rax */
+    emit8(jit, 0x48);
+    emit8(jit, 0xb8);
+    emit64(jit, (unsigned long)d->handler);
+    emit8(jit, 0xff);
+    emit8(jit, 0xd0);
+    emit_reload(jit, a);
+}
+
+/*
+    Skips: compares, then leaves for the instruction after the next one if
+    taken, for the next one otherwise. jump_if_not_taken is the condition
+    code of the short jcc (0x74 je or 0x75 jne) that picks the second exit.
+*/
+static void emit_skip(struct jit *jit, const struct allocation *a, unsigned char jump_if_not_taken,
+        unsigned short address){
+    /* jcc rel32 */
+    emit8(jit, 0x0f);
+    emit8(jit, jump_if_not_taken + 0x10);
+    size_t not_taken = jit->code_used;
+    emit32(jit, 0);
+    emit_exit(jit, a, address + 4);
+    unsigned int displacement = jit->code_used - not_taken - 4;
+    memcpy(jit->code + not_taken, &displacement, 4);
+    emit_exit(jit, a, address + 2);
+}
+
+/* Whether emit_native() translates an instruction, the others go through emit_fallback() */
+static int is_native(unsigned char op){
+    switch(op){
+        case OP_JMP:
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL:
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL:
+        case OP_ILOAD:
+        case OP_IADD:
+        case OP_ASSIGN:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_SHR:
+        case OP_SUBN:
+        case OP_SHL:
+        case OP_SET_INDEX:
+        case OP_JMP_REL:
+        case OP_SET_RAND:
+        case OP_LOAD_DELAY:
+        case OP_SET_DELAY:
+        case OP_SET_SOUND:
+        case OP_ADD_TO_INDEX:
+        case OP_LOAD_LOCATION: {
+            return 1;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+/* Counts the V registers a native instruction reads or writes */
+static void count_uses(const struct decoded_instruction *d, unsigned int *uses){
+    switch(d->op){
+        case OP_ASSIGN:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL: {
+            uses[d->x]++;
+            uses[d->y]++;
+            break;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_SUBN: {
+            uses[d->x]++;
+            uses[d->y]++;
+            uses[0xf]++;
+            break;
+        }
+        case OP_SHR:
+        case OP_SHL: {
+            uses[d->x]++;
+            uses[0xf]++;
+            break;
+        }
+        case OP_JMP_REL: {
+            uses[0]++;
+            break;
+        }
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL:
+        case OP_ILOAD:
+        case OP_IADD:
+        case OP_SET_RAND:
+        case OP_LOAD_DELAY:
+        case OP_SET_DELAY:
+        case OP_SET_SOUND:
+        case OP_ADD_TO_INDEX: {
+            uses[d->x]++;
+            break;
+        }
+    }
+}
+
+/* Gives host registers to the V registers the native instructions use most */
+static void allocate(struct allocation *a, const struct decoded_instruction *list, int count){
+    unsigned int uses[16] = {0};
+    for(int i = 0; i < count; i++){
+        if(is_native(list[i].op)){
+            count_uses(&list[i], uses);
+        }
+    }
+    memset(a->host, -1, sizeof(a->host));
+    a->pinned = 0;
+    a->dirty = 0;
+    for(size_t r = 0; r < PIN_COUNT; r++){
+        int best = -1;
+        for(int x = 0; x < 16; x++){
+            if(uses[x] > 0 && !(a->pinned & (1 << x)) && (best < 0 || uses[x] > uses[best])){
+                best = x;
+            }
+        }
+        if(best < 0){
+            break;
+        }
+        a->host[best] = pin_registers[r];
+        a->pinned |= 1 << best;
+    }
+}
+
+/*
+    Emits native code for an instruction is_native() accepts, with the
+    V registers where a puts them. Instructions that end the block leave it.
+*/
+static void emit_native(struct jit *jit, struct allocation *a, const struct decoded_instruction *d,
+        unsigned short address){
+    switch(d->op){
+        case OP_JMP: {
+            emit_exit(jit, a, d->nnn);
+            break;
+        }
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL: {
+            /* cmp al, kk */
+            emit_load_v(jit, a, RAX, d->x);
+            emit8(jit, 0x3c);
+            emit8(jit, d->kk);
+            emit_skip(jit, a, d->op == OP_ISKIP_ON_EQUAL ? 0x75 : 0x74, address);
+            break;
+        }
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL: {
+            emit_load_v(jit, a, RAX, d->x);
+            emit_load_v(jit, a, RCX, d->y);
+            emit_byte_registers(jit, OPCODE_CMP, RCX, RAX);
+            emit_skip(jit, a, d->op == OP_SKIP_ON_EQUAL ? 0x75 : 0x74, address);
+            break;
+        }
+        case OP_ILOAD: {
+            emit_set_v(jit, a, d->x, d->kk);
+            break;
+        }
+        case OP_IADD: {
+            if(a->host[d->x] >= 0){
+                emit_byte_immediate(jit, DIGIT_ADD, a->host[d->x], d->kk);
+                a->dirty |= 1 << d->x;
+            }else{
+                /* add byte [rbx + x], kk */
+                emit8(jit, 0x80);
+                emit8(jit, 0x40 | RBX);
+                emit8(jit, V_OFFSET(d->x));
+                emit8(jit, d->kk);
+            }
+            break;
+        }
+        case OP_ASSIGN:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR: {
+            static const unsigned char opcodes[] = {
+                [OP_ASSIGN - OP_ASSIGN] = OPCODE_STORE,
+                [OP_OR - OP_ASSIGN] = OPCODE_OR,
+                [OP_AND - OP_ASSIGN] = OPCODE_AND,
+                [OP_XOR - OP_ASSIGN] = OPCODE_XOR,
+            };
+            emit_v_operation(jit, a, opcodes[d->op - OP_ASSIGN], d->x, d->y);
+            break;
+        }
+        /*
+            The flag instructions follow cpu.c step by step, VF may be Vx or
+            Vy. They work on the host registers directly when all their
+            operands are pinned.
+        */
+        case OP_ADD: {
+            if(pinned(a, d->x) && pinned(a, d->y) && pinned(a, 0xf)){
+                /* mov al, Vx; add al, Vy; setc VF; mov Vx, al */
+                emit_byte_registers(jit, OPCODE_STORE, a->host[d->x], RAX);
+                emit_byte_registers(jit, OPCODE_ADD, a->host[d->y], RAX);
+                emit_setcc(jit, SETC, a->host[0xf]);
+                emit_byte_registers(jit, OPCODE_STORE, RAX, a->host[d->x]);
+                a->dirty |= 1 << d->x | 1 << 0xf;
+                break;
+            }
+            emit_load_v(jit, a, RAX, d->x);
+            emit_load_v(jit, a, RCX, d->y);
+            emit_byte_registers(jit, OPCODE_ADD, RCX, RAX);
+            emit_setcc(jit, SETC, RCX);
+            emit_store_v(jit, a, 0xf, RCX);
+            emit_store_v(jit, a, d->x, RAX);
+            break;
+        }
+        case OP_SUB:
+        case OP_SUBN: {
+            /* SUB is Vx = Vx - Vy, SUBN Vx = Vy - Vx, VF is whether the result is not below the subtrahend */
+            unsigned char minuend = d->op == OP_SUB ? d->x : d->y;
+            unsigned char subtrahend = d->op == OP_SUB ? d->y : d->x;
+            if(pinned(a, d->x) && pinned(a, d->y) && pinned(a, 0xf)){
+                /* mov al, minuend; sub al, subtrahend; mov Vx, al; cmp minuend, subtrahend; setae VF */
+                emit_byte_registers(jit, OPCODE_STORE, a->host[minuend], RAX);
+                emit_byte_registers(jit, OPCODE_SUB, a->host[subtrahend], RAX);
+                emit_byte_registers(jit, OPCODE_STORE, RAX, a->host[d->x]);
+                emit_byte_registers(jit, OPCODE_CMP, a->host[subtrahend], a->host[minuend]);
+                emit_setcc(jit, SETAE, a->host[0xf]);
+                a->dirty |= 1 << d->x | 1 << 0xf;
+                break;
+            }
+            emit_load_v(jit, a, RAX, minuend);
+            emit_load_v(jit, a, RCX, subtrahend);
+            emit_byte_registers(jit, OPCODE_SUB, RCX, RAX);
+            emit_store_v(jit, a, d->x, RAX);
+            emit_load_v(jit, a, RAX, minuend);
+            emit_load_v(jit, a, RCX, subtrahend);
+            emit_byte_registers(jit, OPCODE_CMP, RCX, RAX);
+            emit_setcc(jit, SETAE, RAX);
+            emit_store_v(jit, a, 0xf, RAX);
+            break;
+        }
+        case OP_SHR:
+        case OP_SHL: {
+            if(pinned(a, d->x) && pinned(a, 0xf)){
+                /* mov al, Vx; and al, mask; mov VF, al; shr/shl Vx, 1 */
+                emit_byte_registers(jit, OPCODE_STORE, a->host[d->x], RAX);
+                emit_byte_immediate(jit, DIGIT_AND, RAX, d->op == OP_SHR ? 0x01 : 0x80);
+                emit_byte_registers(jit, OPCODE_STORE, RAX, a->host[0xf]);
+                emit_rex(jit, 0, a->host[d->x]);
+                emit8(jit, 0xd0);
+                emit8(jit, (d->op == OP_SHR ? 0xe8 : 0xe0) | (a->host[d->x] & 7));
+                a->dirty |= 1 << d->x | 1 << 0xf;
+                break;
+            }
+            emit_load_v(jit, a, RAX, d->x);
+            emit_byte_immediate(jit, DIGIT_AND, RAX, d->op == OP_SHR ? 0x01 : 0x80);
+            emit_store_v(jit, a, 0xf, RAX);
+            emit_load_v(jit, a, RAX, d->x);
+            /* shr al, 1 or shl al, 1 */
+            emit_rex(jit, 0, RAX);
+            emit8(jit, 0xd0);
+            emit8(jit, d->op == OP_SHR ? 0xe8 : 0xe0);
+            emit_store_v(jit, a, d->x, RAX);
+            break;
+        }
+        case OP_SET_INDEX: {
+            /* mov word [I], nnn */
+            emit8(jit, 0x66);
+            emit8(jit, 0xc7);
+            emit_chip_operand(jit, 0, INDEX_OFFSET);
+            emit16(jit, d->nnn);
+            break;
+        }
+        case OP_ADD_TO_INDEX: {
+            /* movzx eax, Vx; add word [I], ax */
+            emit_load_v(jit, a, RAX, d->x);
+            emit8(jit, 0x0f);
+            emit8(jit, 0xb6);
+            emit8(jit, 0xc0);
+            emit8(jit, 0x66);
+            emit8(jit, 0x01);
+            emit_chip_operand(jit, RAX, INDEX_OFFSET);
+            break;
+        }
+        case OP_JMP_REL: {
+            /* movzx eax, V0; add eax, nnn; mov word [pc], ax */
+            emit_load_v(jit, a, RAX, 0);
+            emit8(jit, 0x0f);
+            emit8(jit, 0xb6);
+            emit8(jit, 0xc0);
+            emit8(jit, 0x05);
+            emit32(jit, d->nnn);
+            emit8(jit, 0x66);
+            emit8(jit, 0x89);
+            emit_chip_operand(jit, RAX, PC_OFFSET);
+            emit_write_back(jit, a);
+            emit_chain(jit);
+            break;
+        }
+        case OP_SET_RAND: {
+            /* The xorshift32 step of set_rand(), with eax the state and ecx scratch */
+            static const unsigned char shifts[][3] = {
+                {0xe1, 13},
+                {0xe9, 17},
+                {0xe1, 5},
+            };
+            emit8(jit, 0x8b);
+            emit_chip_operand(jit, RAX, RNG_OFFSET);
+            for(int i = 0; i < 3; i++){
+                /* mov ecx, eax; shl/shr ecx, n; xor eax, ecx */
+                emit8(jit, 0x89);
+                emit8(jit, 0xc1);
+                emit8(jit, 0xc1);
+                emit8(jit, shifts[i][0]);
+                emit8(jit, shifts[i][1]);
+                emit8(jit, 0x31);
+                emit8(jit, 0xc8);
+            }
+            emit8(jit, 0x89);
+            emit_chip_operand(jit, RAX, RNG_OFFSET);
+            /* shr eax, 24; and al, kk */
+            emit8(jit, 0xc1);
+            emit8(jit, 0xe8);
+            emit8(jit, 24);
+            emit8(jit, 0x24);
+            emit8(jit, d->kk);
+            emit_store_v(jit, a, d->x, RAX);
+            break;
+        }
+        case OP_LOAD_DELAY: {
+            /* mov al, [delay] */
+            emit8(jit, 0x8a);
+            emit_chip_operand(jit, RAX, DELAY_OFFSET);
+            emit_store_v(jit, a, d->x, RAX);
+            break;
+        }
+        case OP_SET_DELAY:
+        case OP_SET_SOUND: {
+            /* mov [timer], al */
+            emit_load_v(jit, a, RAX, d->x);
+            emit8(jit, 0x88);
+            emit_chip_operand(jit, RAX, d->op == OP_SET_DELAY ? DELAY_OFFSET : SOUND_OFFSET);
+            break;
+        }
+        case OP_LOAD_LOCATION: {
+            /* load_location() only moves the PC on */
+            break;
+        }
+    }
+}
+
+/*
+    Instructions after which the block must return to the dispatcher: the
+    ones that change the control flow and the ones that may write over code.
+*/
+static int ends_block(unsigned char op){
+    switch(op){
+        case OP_RET:
+        case OP_JMP:
+        case OP_CALL:
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL:
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL:
+        case OP_JMP_REL:
+        case OP_SKIP_PRESSED:
+        case OP_SKIP_NOT_PRESSED:
+        case OP_STORE_BCD:
+        case OP_STORE_REGISTERS: {
+            return 1;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+/* Instructions whose handlers may end the frame, they are never compiled */
+static int may_yield(unsigned char op){
+    return op == OP_WAIT_FOR_KEY || op == OP_WAIT_DELAY || op == OP_JMP_SELF;
+}
+
+/*
+    The instructions of a block, with a budget check in front of each one
+    if checked is set. Without the checks the block must only be entered
+    with enough budget for all of it, which the caller has taken off ebp.
+*/
+static void emit_instructions(struct jit *jit, struct allocation *a, const struct decoded_instruction *list,
+        int count, unsigned short address, int checked){
+    for(int i = 0; i < count; i++){
+        const struct decoded_instruction *d = &list[i];
+        if(checked){
+            emit_budget_check(jit, a, address);
+        }
+        if(is_native(d->op)){
+            emit_native(jit, a, d, address);
+        }else{
+            emit_fallback(jit, a, d, address);
+            if(ends_block(d->op)){
+                emit_chain(jit);
+            }
+        }
+        address += 2;
+    }
+    if(!ends_block(list[count - 1].op)){
+        emit_exit(jit, a, address);
+    }
+}
+
+/* Sets the protection of the whole code buffer, 0 on success */
+static int protect_code(struct jit *jit, int protection){
+    if(mprotect(jit->code, JIT_CODE_SIZE, protection) != 0){
+        perror("Could not change the protection of the JIT code");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Translates the straight line run of instructions starting at an even
+    address. The V registers the run uses most are loaded into host
+    registers once and stored back when the block is left. The run is
+    emitted twice: as is, for when the budget covers all of it, and with a
+    check of the budget in front of every instruction for when it does not.
+    Returns NULL if not even the first instruction can be compiled.
+*/
+static jit_block compile_block(struct jit *jit, struct chip8 *chip, unsigned short start){
+    /* Each block is emitted twice */
+    if(jit->code_used + 2 * JIT_MAX_BLOCK_LENGTH * JIT_MAX_INSTRUCTION_SIZE > JIT_CODE_SIZE ||
+            jit->operands_used + JIT_MAX_BLOCK_LENGTH > JIT_OPERANDS_SIZE){
+        jit_flush(jit);
+    }
+
+    struct decoded_instruction list[JIT_MAX_BLOCK_LENGTH];
+    unsigned short address = start;
+    int count = 0;
+    while(count < JIT_MAX_BLOCK_LENGTH && address < 0x1000 - 1){
+        /* The decode cache's view, idle loops stop the block like they stop decode() */
+        struct decoded_instruction *d = &list[count];
+        predecode_at(chip, d, address);
+        if(d->op == OP_INVALID || may_yield(d->op)){
+            break;
+        }
+        predecode(d, chip->memory[address] << 8 | chip->memory[address + 1]);
+        /* Whether this is an idle loop depends on the two instructions after it */
+        jit->covered[address >> 1] = 1;
+        jit->covered[((address + 2) & 0xfff) >> 1] = 1;
+        jit->covered[((address + 4) & 0xfff) >> 1] = 1;
+        count++;
+        address += 2;
+        if(ends_block(d->op)){
+            break;
+        }
+    }
+    if(count == 0){
+        return NULL;
+    }
+
+    if(protect_code(jit, PROT_READ | PROT_WRITE) < 0){
+        return NULL;
+    }
+    struct allocation a;
+    allocate(&a, list, count);
+    unsigned char *entry = jit->code + jit->code_used;
+    emit_prologue(jit);
+    unsigned char *body = jit->code + jit->code_used;
+    emit_reload(jit, &a);
+    /* cmp ebp, count; jl checked; sub ebp, count */
+    emit8(jit, 0x83);
+    emit8(jit, 0xfd);
+    emit8(jit, count);
+    emit8(jit, 0x0f);
+    emit8(jit, 0x8c);
+    size_t checked = jit->code_used;
+    emit32(jit, 0);
+    emit8(jit, 0x83);
+    emit8(jit, 0xed);
+    emit8(jit, count);
+    emit_instructions(jit, &a, list, count, start, 0);
+    unsigned int displacement = jit->code_used - checked - 4;
+    memcpy(jit->code + checked, &displacement, 4);
+    a.dirty = 0;
+    emit_instructions(jit, &a, list, count, start, 1);
+
+    if(protect_code(jit, PROT_READ | PROT_EXEC) < 0){
+        /* Nothing can run from the buffer any more */
+        jit_flush(jit);
+        return NULL;
+    }
+    jit->bodies[start >> 1] = body;
+    return (jit_block)entry;
+}
+
+/*
+    Runs the machine through compiled blocks, with the same contract as
+    decode(). Blocks are handed the budget that is left and stop when it
+    runs out, so the machine ends where the interpreters would. Idle loops,
+    Fx0A and instructions that start no block go through the decode cache,
+    odd addresses through the reference decoder.
+*/
+long decode_jit(struct chip8 *chip, long budget){
+    if(chip->jit == NULL){
+        chip->jit = new_jit();
+        if(chip->jit == NULL){
+            return decode(chip, budget);
+        }
+    }
+    struct jit *jit = chip->jit;
+    long executed = 0;
+
+    while(executed < budget){
+        if(chip->pc >= 0x1000 - 1){
+            perror("Invalid memory address\n");
+            return -1;
+        }
+        if(jit->flush_pending){
+            jit_flush(jit);
+        }
+        if(chip->pc & 1){
+            int status = execute(chip, fetch(chip));
+            if(status < 0){
+                perror("Invalid instruction\n");
+                return -1;
+            }
+            executed++;
+            if(status > 0){
+                break;
+            }
+            continue;
+        }
+
+        jit_block block = jit->blocks[chip->pc >> 1];
+        if(block != NULL){
+            long left = budget - executed;
+            executed += block(chip, left < INT_MAX ? left : INT_MAX);
+            continue;
+        }
+
+        struct decoded_instruction *d = &chip->decode_cache[chip->pc >> 1];
+        if(d->handler == NULL){
+            predecode_at(chip, d, chip->pc);
+        }
+        if(!may_yield(d->op)){
+            block = compile_block(jit, chip, chip->pc);
+            jit->blocks[chip->pc >> 1] = block;
+            if(block != NULL){
+                continue;
+            }
+        }
+        executed++;
+        int status;
+        if(!IS_FUSED_OP(d->op)){
+            status = d->handler(chip, d);
+        }else if(executed < budget){
+            executed++;
+            status = d->handler(chip, d);
+        }else{
+            status = execute(chip, fetch(chip));
+        }
+        if(status < 0){
+            perror("Invalid instruction\n");
+            return -1;
+        }
+        if(status > 0){
+            break;
+        }
+    }
+    return executed;
+}
+
+#else
+
+/* The recompiler only targets x86-64 Linux, other hosts use the switch core */
+struct jit *new_jit(){
+    return NULL;
+}
+
+void free_jit(struct jit *jit){
+}
+
+void jit_flush(struct jit *jit){
+}
+
+void jit_invalidate(struct jit *jit, unsigned short address){
+}
+
+long decode_jit(struct chip8 *chip, long budget){
+    return decode(chip, budget);
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef JIT_H
+#define JIT_H
+
+struct chip8;
+struct jit;
+
+struct jit *new_jit();
+void free_jit(struct jit *);
+void jit_invalidate(struct jit *, unsigned short);
+void jit_flush(struct jit *);
+long decode_jit(struct chip8 *, long);
+
+#endif
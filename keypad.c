@@ -0,0 +1,106 @@
+#include <time.h>
+#include "cpu.h"
+#include "keypad.h"
+
+void init_keypad(struct keypad *keypad){
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    /* Timeouts must not jump with the wall clock */
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&keypad->event, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&keypad->lock, NULL);
+    keypad->state = 0;
+    keypad->presses = 0;
+    keypad->polled_state = 0;
+    keypad->polled_presses = 0;
+}
+
+void destroy_keypad(struct keypad *keypad){
+    pthread_cond_destroy(&keypad->event);
+    pthread_mutex_destroy(&keypad->lock);
+}
+
+/* Records a key going down or up. Safe to call from any thread. */
+void key_event(struct chip8 *chip, unsigned char key, int pressed){
+    struct keypad *keypad = &chip->keypad;
+    unsigned short bit = 1 << (key & 0xf);
+
+    pthread_mutex_lock(&keypad->lock);
+    if(pressed){
+        keypad->state |= bit;
+        keypad->presses |= bit;
+    }else{
+        keypad->state &= ~bit;
+    }
+    pthread_cond_signal(&keypad->event);
+    pthread_mutex_unlock(&keypad->lock);
+}
+
+/*
+    Replaces the held keys and the presses since the last poll, so that a
+    recording can be played back exactly
+*/
+void set_keypad(struct chip8 *chip, unsigned short state, unsigned short presses){
+    struct keypad *keypad = &chip->keypad;
+
+    pthread_mutex_lock(&keypad->lock);
+    keypad->state = state;
+    keypad->presses = presses;
+    pthread_mutex_unlock(&keypad->lock);
+}
+
+/*
+    Copies the key state into the machine. A machine blocked on Fx0A gets
+    the lowest key pressed since the last poll and moves past the Fx0A.
+*/
+void poll_keys(struct chip8 *chip){
+    struct keypad *keypad = &chip->keypad;
+
+    pthread_mutex_lock(&keypad->lock);
+    unsigned short state = keypad->state;
+    unsigned short presses = keypad->presses;
+    keypad->presses = 0;
+    keypad->polled_state = state;
+    keypad->polled_presses = presses;
+    pthread_mutex_unlock(&keypad->lock);
+
+    for(int i = 0; i < 16; i++){
+        chip->keys[i] = (state >> i) & 1;
+    }
+    if(chip->waiting_for_key && presses != 0){
+        chip->registers[chip->key_register] = __builtin_ctz(presses);
+        chip->waiting_for_key = 0;
+        chip->pc += 2;
+    }
+}
+
+/*
+    Parks the calling thread until a key event arrives or the monotonic
+    clock reaches deadline, whichever comes first
+*/
+void wait_for_input_until(struct chip8 *chip, const struct timespec *deadline){
+    struct keypad *keypad = &chip->keypad;
+
+    pthread_mutex_lock(&keypad->lock);
+    while(keypad->presses == 0){
+        if(pthread_cond_timedwait(&keypad->event, &keypad->lock, deadline) != 0){
+            break;
+        }
+    }
+    pthread_mutex_unlock(&keypad->lock);
+}
+
+/* Same, with a deadline timeout_ns nanoseconds from now */
+void wait_for_input(struct chip8 *chip, long timeout_ns){
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    wait_for_input_until(chip, &deadline);
+}
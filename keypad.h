@@ -0,0 +1,42 @@
+#ifndef KEYPAD_H
+#define KEYPAD_H
+
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct chip8;
+
+/*
+    Key events coming from the input thread. They are applied to the machine
+    at frame boundaries by poll_keys(), so the emulation thread never reads
+    state that is being written.
+*/
+struct keypad{
+    pthread_mutex_t lock;
+    pthread_cond_t event;
+    /* One bit per key, set while the key is held */
+    unsigned short state;
+    /* Keys pressed since the last poll, so short taps are not lost */
+    unsigned short presses;
+    /* What the last poll_keys applied, for recording input */
+    unsigned short polled_state;
+    unsigned short polled_presses;
+};
+
+void init_keypad(struct keypad *);
+void destroy_keypad(struct keypad *);
+void key_event(struct chip8 *, unsigned char, int);
+void set_keypad(struct chip8 *, unsigned short, unsigned short);
+void poll_keys(struct chip8 *);
+void wait_for_input_until(struct chip8 *, const struct timespec *);
+void wait_for_input(struct chip8 *, long);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "jit.h"
+#include "hash.h"
+#include "libchip8.h"
+
+struct chip8_handle{
+    struct chip8 chip;
+    core_fn core;
+};
+
+/* A machine in its reset state with no ROM, running on the switch based core */
+CHIP8_API struct chip8_handle *chip8_create(void){
+    struct chip8_handle *handle = malloc(sizeof(struct chip8_handle));
+    if(handle == NULL){
+        perror("Machine allocation failed");
+        return NULL;
+    }
+    init_chip8(&handle->chip);
+    handle->core = decode;
+    return handle;
+}
+
+CHIP8_API void chip8_destroy(struct chip8_handle *handle){
+    if(handle != NULL){
+        release_chip8(&handle->chip);
+        free(handle);
+    }
+}
+
+/* Copies a ROM image to 0x200. Returns -1 if it does not fit. */
+CHIP8_API int chip8_load_rom(struct chip8_handle *handle, const unsigned char *rom, size_t size){
+    return load_rom_buffer(&handle->chip, rom, size);
+}
+
+/* Seeds Cxkk, machines are seeded from the clock otherwise */
+CHIP8_API void chip8_seed(struct chip8_handle *handle, unsigned int seed){
+    seed_chip8(&handle->chip, seed);
+}
+
+CHIP8_API void chip8_set_core(struct chip8_handle *handle, enum chip8_core core){
+    switch(core){
+        case CHIP8_CORE_THREADED: {
+            handle->core = decode_threaded;
+            break;
+        }
+        case CHIP8_CORE_JIT: {
+            handle->core = decode_jit;
+            break;
+        }
+        default: {
+            handle->core = decode;
+            break;
+        }
+    }
+}
+
+/* 10 by default. Returns -1 for 0 or more than 65535. */
+CHIP8_API int chip8_set_instructions_per_frame(struct chip8_handle *handle, unsigned int instructions){
+    if(instructions == 0 || instructions > 0xffff){
+        return -1;
+    }
+    handle->chip.instructions_per_frame = instructions;
+    return 0;
+}
+
+/*
+    Applies the key events so far and runs up to n instructions, without
+    ticking the timers. Returns how many ran, fewer when the ROM idles or
+    waits for a key, or -1 on an invalid instruction.
+*/
+CHIP8_API long chip8_step(struct chip8_handle *handle, long n){
+    poll_keys(&handle->chip);
+    if(handle->chip.waiting_for_key){
+        return 0;
+    }
+    return handle->core(&handle->chip, n);
+}
+
+/* One 60Hz frame: keys, instructions, timer tick. Returns -1 on an invalid instruction. */
+CHIP8_API int chip8_run_frame(struct chip8_handle *handle){
+    return run_frame(&handle->chip, handle->core);
+}
+
+/* CHIP8_HEIGHT rows, the most significant bit is the leftmost pixel. Changes as the machine runs. */
+CHIP8_API const uint64_t *chip8_framebuffer(const struct chip8_handle *handle){
+    return handle->chip.display_memory;
+}
+
+CHIP8_API int chip8_pixel(const struct chip8_handle *handle, int x, int y){
+    if(x < 0 || x >= CHIP8_WIDTH || y < 0 || y >= CHIP8_HEIGHT){
+        return 0;
+    }
+    return (handle->chip.display_memory[y] >> (CHIP8_WIDTH - 1 - x)) & 1;
+}
+
+/* Bit n is set if row n changed since the last call */
+CHIP8_API uint32_t chip8_take_dirty_rows(struct chip8_handle *handle){
+    uint32_t dirty = handle->chip.dirty_rows;
+    handle->chip.dirty_rows = 0;
+    return dirty;
+}
+
+/* Whether the buzzer sounds, as long as the sound timer is running */
+CHIP8_API int chip8_sound_active(const struct chip8_handle *handle){
+    return handle->chip.sound_timer != 0;
+}
+
+/* A key 0-F going down or up. Safe to call from any thread. */
+CHIP8_API void chip8_key(struct chip8_handle *handle, int key, int pressed){
+    key_event(&handle->chip, key, pressed);
+}
+
+/* Equal for machines in the same state, whichever core ran them */
+CHIP8_API uint64_t chip8_state_hash(const struct chip8_handle *handle){
+    return hash_state(&handle->chip);
+}
@@ -0,0 +1,73 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vec_env.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    The emulator as a library, libchip8.a or libchip8.so. Every machine
+    lives in its own handle and the library keeps no other mutable state,
+    so any number of handles can run at the same time on different
+    threads. A handle itself must only be stepped by one thread at a time;
+    chip8_key may be called from any thread.
+
+        struct chip8_handle *chip = chip8_create();
+        chip8_load_rom(chip, rom, size);
+        while(running){
+            chip8_run_frame(chip);
+            draw(chip8_framebuffer(chip), chip8_take_dirty_rows(chip));
+        }
+        chip8_destroy(chip);
+
+    Many copies of one ROM stepped together, as a vectorized environment
+    for training agents, are the chip8_vec_env of vec_env.h, which comes
+    with this header.
+
+    Only the functions here and in vec_env.h are exported, everything else
+    is internal.
+*/
+
+/* Marks the exported functions, the library is built with everything else hidden */
+#define CHIP8_API __attribute__((visibility("default")))
+
+#define CHIP8_WIDTH 64
+#define CHIP8_HEIGHT 32
+
+struct chip8_handle;
+
+enum chip8_core{
+    /* The switch based interpreter */
+    CHIP8_CORE_SWITCH,
+    /* The computed goto interpreter */
+    CHIP8_CORE_THREADED,
+    /* The x86-64 recompiler, falls back to interpreting elsewhere */
+    CHIP8_CORE_JIT
+};
+
+struct chip8_handle *chip8_create(void);
+void chip8_destroy(struct chip8_handle *);
+int chip8_load_rom(struct chip8_handle *, const unsigned char *, size_t);
+void chip8_seed(struct chip8_handle *, unsigned int);
+void chip8_set_core(struct chip8_handle *, enum chip8_core);
+int chip8_set_instructions_per_frame(struct chip8_handle *, unsigned int);
+
+long chip8_step(struct chip8_handle *, long);
+int chip8_run_frame(struct chip8_handle *);
+
+const uint64_t *chip8_framebuffer(const struct chip8_handle *);
+int chip8_pixel(const struct chip8_handle *, int, int);
+uint32_t chip8_take_dirty_rows(struct chip8_handle *);
+int chip8_sound_active(const struct chip8_handle *);
+void chip8_key(struct chip8_handle *, int, int);
+uint64_t chip8_state_hash(const struct chip8_handle *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
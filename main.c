@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "jit.h"
+#include "movie.h"
+#include "profile.h"
+#include "headless.h"
+#include "scheduler.h"
+#include "quirks.h"
+#ifdef CHIP8_SDL
+#include <pthread.h>
+#include <stdatomic.h>
+#include "display.h"
+#include "triple_buffer.h"
+#include "rewind.h"
+
+/* 10 minutes of frames, typically a few MB of deltas */
+#define REWIND_FRAMES (60 * 60 * 10)
+#define REWIND_BYTES (8 << 20)
+#define REWIND_KEYFRAME_INTERVAL 60
+
+struct emulation{
+    struct chip8 *chip;
+    core_fn core;
+    struct rewind *rewind;
+    /* Input being recorded, or NULL */
+    struct chip8_movie *movie;
+    atomic_int running;
+    /* Set by the render thread while the rewind key is held */
+    atomic_int rewinding;
+    struct scheduler scheduler;
+};
+
+/* Runs the machine on its own thread, finished frames go out through chip->output */
+static void *emulate(void *argument){
+    struct emulation *emulation = argument;
+    struct chip8 *chip = emulation->chip;
+
+    start_scheduler(&emulation->scheduler);
+    while(atomic_load(&emulation->running)){
+        int rewinding = emulation->rewind != NULL && atomic_load(&emulation->rewinding);
+        if(rewinding){
+            /* One frame back per frame, the restored state marks every row dirty */
+            if(rewind_step_back(emulation->rewind, chip) == 0){
+                publish_frame(chip->output, chip->display_memory, chip->dirty_rows);
+                chip->dirty_rows = 0;
+                /* The recording follows, so it replays into the state the player went on from */
+                if(emulation->movie != NULL){
+                    movie_truncate(emulation->movie, emulation->movie->header.frames - 1);
+                }
+            }
+        }else{
+            if(run_frame(chip, emulation->core) != 0){
+                break;
+            }
+            if(emulation->rewind != NULL){
+                rewind_push(emulation->rewind, chip);
+            }
+            if(emulation->movie != NULL && movie_record_frame(emulation->movie, chip) < 0){
+                perror("Recording stopped");
+                break;
+            }
+        }
+        /* Key events that arrive meanwhile are latched, a press wakes Fx0A at once */
+        wait_for_frame(&emulation->scheduler, rewinding ? NULL : chip);
+    }
+    atomic_store(&emulation->running, 0);
+    return NULL;
+}
+#endif
+
+#ifdef CHIP8_PROFILE
+/* Writes the profile next to where the emulator was started */
+static void write_profile(const struct chip8_profile *profile){
+    FILE *json = fopen("chip8-profile.json", "w");
+    FILE *folded = fopen("chip8-profile.folded", "w");
+    if(json == NULL || folded == NULL || write_profile_json(profile, json) < 0 ||
+            write_profile_folded(profile, folded) < 0){
+        perror("Error writing the profile");
+    }else{
+        fprintf(stderr, "Profile written to chip8-profile.json and chip8-profile.folded\n");
+    }
+    if(json != NULL){
+        fclose(json);
+    }
+    if(folded != NULL){
+        fclose(folded);
+    }
+}
+#endif
+
+/* Plays a movie headless at full speed, returns the exit status */
+static int play(struct chip8 *chip, core_fn core, const char *path){
+    struct chip8_movie *movie = load_movie(path);
+    if(movie == NULL){
+        return 1;
+    }
+    if(start_movie(movie, chip) < 0){
+        fprintf(stderr, "%s was recorded on a different ROM\n", path);
+        free_chip8_movie(movie);
+        return 1;
+    }
+
+    long frame;
+    enum movie_result result = replay_movie(movie, chip, core, &frame);
+    switch(result){
+        case MOVIE_MATCH: {
+            printf("Replay matched all %ld frames\n", frame);
+            break;
+        }
+        case MOVIE_DESYNC: {
+            printf("Replay desynced at frame %ld\n", frame);
+            break;
+        }
+        case MOVIE_FAULT: {
+            printf("Replay faulted at frame %ld\n", frame);
+            break;
+        }
+    }
+    free_chip8_movie(movie);
+    return result != MOVIE_MATCH;
+}
+
+/*
+    Usage: a [-t | -j | -q quirks] [-f | -n] [-s seed] [-i ipf] [-r movie | -p movie]
+             [-c cycles] [-F frames] [-x pc] [-m condition] [-o image] [rom]
+    -t selects the threaded interpreter core instead of the switch based one
+    -j runs the ROM through the x86-64 recompiler
+    -q runs the core specialised for a variant's quirks, a comma separated
+       list of shift, index, jump, clip and vfreset, or vip or schip. See
+       quirks.h. -q none ends in the same states as the other cores, any
+       quirk changes the state hashes of the ROMs it applies to.
+    -f prints how often each superinstruction ran, in a profiling build
+    -n disables superinstructions
+    -s seeds the random number generator, for reproducible runs. Headless
+       runs use seed 0 unless told otherwise, so their hashes are repeatable.
+    -i instructions per 60Hz frame, 10 by default. Frames are paced to the
+       monotonic clock, the host sleeps in between.
+    -r records the input into a movie file, in the SDL build
+    -p plays a movie back headless as fast as possible and reports whether
+       it stayed in sync
+
+    Any of the following runs the ROM headless, without a window or any
+    pacing, see run_headless(), and prints the exit reason and the state
+    and framebuffer hashes:
+    -c stops after this many instructions
+    -F stops after this many frames
+    -x stops before the instruction at this address. Idle loops are not
+       collapsed, so that no address is passed over.
+    -m stops at the end of the first frame a memory byte meets a condition,
+       "address op value" with op one of == != < <= > >=
+    -o writes the final framebuffer as a PBM image
+
+    A profiling build (make PROFILE=1) always runs the switch based core
+    and writes chip8-profile.json and chip8-profile.folded on exit.
+*/
+int main(int argc, char **argv){
+    core_fn core = decode;
+    const char *rom = "chip8-test-rom/test_opcode.ch8";
+    int fusion_stats = 0;
+    int fusion_enabled = 1;
+    int seeded = 0;
+    unsigned int seed = 0;
+    const char *record = NULL;
+    const char *playback = NULL;
+    long instructions_per_frame = INSTRUCTIONS_PER_FRAME;
+    int headless = 0;
+    struct headless_run run = {.exit_pc = -1};
+    int opt;
+
+    while((opt = getopt(argc, argv, "tjq:fns:i:r:p:c:F:x:m:o:")) != -1){
+        switch(opt){
+            case 't': {
+                core = decode_threaded;
+                break;
+            }
+            case 'j': {
+                core = decode_jit;
+                break;
+            }
+            case 'q': {
+                unsigned int quirks;
+                if(parse_quirks(optarg, &quirks) < 0){
+                    fprintf(stderr, "Unknown quirks: %s\n", optarg);
+                    return 1;
+                }
+                core = quirks_core(quirks);
+                break;
+            }
+            case 'f': {
+#ifndef CHIP8_PROFILE
+                fprintf(stderr, "-f needs a profiling build, make PROFILE=1\n");
+                return 1;
+#endif
+                fusion_stats = 1;
+                break;
+            }
+            case 'n': {
+                fusion_enabled = 0;
+                break;
+            }
+            case 's': {
+                seeded = 1;
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            }
+            case 'i': {
+                instructions_per_frame = strtol(optarg, NULL, 0);
+                if(instructions_per_frame < 1 || instructions_per_frame > 0xffff){
+                    fprintf(stderr, "Instructions per frame must be between 1 and 65535\n");
+                    return 1;
+                }
+                break;
+            }
+            case 'r': {
+                record = optarg;
+                break;
+            }
+            case 'p': {
+                playback = optarg;
+                break;
+            }
+            case 'c': {
+                headless = 1;
+                run.cycles = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 'F': {
+                headless = 1;
+                run.frames = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 'x': {
+                headless = 1;
+                run.exit_pc = strtol(optarg, NULL, 0) & 0xfff;
+                break;
+            }
+            case 'm': {
+                headless = 1;
+                if(parse_condition(optarg, &run.exit_condition) < 0){
+                    fprintf(stderr, "Bad condition: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'o': {
+                headless = 1;
+                run.framebuffer = optarg;
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: %s [-t | -j | -q quirks] [-f | -n] [-s seed] [-i ipf] [-r movie | -p movie]\n"
+                        "       [-c cycles] [-F frames] [-x pc] [-m condition] [-o image] [rom]\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    if(optind < argc){
+        rom = argv[optind];
+    }
+
+    struct chip8 *chip = new_chip8();
+    chip->fusion_enabled = fusion_enabled;
+    /* A collapsed idle loop leaves its Fx07 without running the 3x00 and 1nnn after it */
+    chip->idle_detection = !(headless && run.exit_pc >= 0);
+    chip->instructions_per_frame = instructions_per_frame;
+#ifdef CHIP8_PROFILE
+    /* Only decode() is instrumented */
+    core = decode;
+    chip->profile = new_chip8_profile();
+#endif
+    /* The state hash covers the generator, headless runs must not seed from the clock */
+    if(seeded || headless){
+        seed_chip8(chip, seed);
+    }
+    errno = 0;
+    load_rom(chip, rom);
+    if(headless){
+        /* Nothing but the results goes to stdout, and nothing is set up that the run does not use */
+        int status = errno == EINVAL || errno == ENOMEM ? 1 : run_headless(chip, core, &run);
+        if(fusion_stats){
+            print_fusion_stats(stderr, chip);
+        }
+#ifdef CHIP8_PROFILE
+        if(chip->profile != NULL){
+            write_profile(chip->profile);
+            free_chip8_profile(chip->profile);
+        }
+#endif
+        free_chip8(chip);
+        return status;
+    }
+    if(errno != EINVAL && errno != ENOMEM){
+        printf("Successfully loaded ROM in memory\n");
+    }
+    if(playback != NULL){
+        int status = play(chip, core, playback);
+#ifdef CHIP8_PROFILE
+        if(chip->profile != NULL){
+            write_profile(chip->profile);
+            free_chip8_profile(chip->profile);
+        }
+#endif
+        free_chip8(chip);
+        return status;
+    }
+
+#ifdef CHIP8_SDL
+    struct display *display = new_display(10);
+    if(display == NULL){
+        free_chip8(chip);
+        return 1;
+    }
+    struct triple_buffer frames;
+    init_triple_buffer(&frames);
+    chip->output = &frames;
+
+    /* Rewinding is optional, the emulator runs without it */
+    struct emulation emulation = {chip, core, new_rewind(REWIND_BYTES, REWIND_FRAMES, REWIND_KEYFRAME_INTERVAL)};
+    atomic_init(&emulation.running, 1);
+    atomic_init(&emulation.rewinding, 0);
+    if(record != NULL){
+        /* The seed goes into the movie, so unseeded runs pick one now */
+        emulation.movie = new_chip8_movie(chip, seeded ? seed : (unsigned int)time(NULL), 0);
+    }
+    pthread_t emulation_thread;
+    if(pthread_create(&emulation_thread, NULL, emulate, &emulation) != 0){
+        perror("Could not start the emulation thread");
+        if(emulation.movie != NULL){
+            free_chip8_movie(emulation.movie);
+        }
+        if(emulation.rewind != NULL){
+            free_rewind(emulation.rewind);
+        }
+        free_display(display);
+        free_chip8(chip);
+        return 1;
+    }
+
+    /*
+        This thread only renders. Presenting blocks on vsync and always shows
+        the newest frame, frames finished in between are skipped.
+    */
+    while(atomic_load(&emulation.running) && display_poll_events(display, chip) == 0){
+        atomic_store(&emulation.rewinding, display_rewind_held(display));
+        const struct frame *frame = take_frame(&frames);
+        if(frame != NULL){
+            display_present(display, frame->rows, frame->dirty);
+        }else{
+            display_present(display, NULL, 0);
+        }
+    }
+    atomic_store(&emulation.running, 0);
+    pthread_join(emulation_thread, NULL);
+    if(emulation.movie != NULL){
+        save_movie(emulation.movie, record);
+        free_chip8_movie(emulation.movie);
+    }
+    if(emulation.rewind != NULL){
+        free_rewind(emulation.rewind);
+    }
+    free_display(display);
+#else
+    if(record != NULL){
+        fprintf(stderr, "Recording needs a window, build with make SDL=1\n");
+        free_chip8(chip);
+        return 1;
+    }
+    /* Real time, -c or -F run as fast as the core goes */
+    struct scheduler scheduler;
+    start_scheduler(&scheduler);
+    while(run_frame(chip, core) == 0){
+        wait_for_frame(&scheduler, chip);
+    }
+#endif
+    if(fusion_stats){
+        print_fusion_stats(stderr, chip);
+    }
+#ifdef CHIP8_PROFILE
+    if(chip->profile != NULL){
+        write_profile(chip->profile);
+        free_chip8_profile(chip->profile);
+    }
+#endif
+    free_chip8(chip);
+}
\ No newline at end of file
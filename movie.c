@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "hash.h"
+#include "movie.h"
+
+static size_t checkpoint_count(size_t frames, size_t interval){
+    return frames / interval;
+}
+
+/* The per frame check, see movie.h */
+static uint32_t frame_check(const struct chip8 *chip){
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, chip->registers, sizeof(chip->registers));
+    hash = fnv1a(hash, &chip->index_register, sizeof(chip->index_register));
+    hash = fnv1a(hash, &chip->pc, sizeof(chip->pc));
+    hash = fnv1a(hash, &chip->rng_state, sizeof(chip->rng_state));
+    return hash ^ hash >> 32;
+}
+
+/* Makes room for frames frames, returns -1 if that fails */
+static int reserve_frames(struct chip8_movie *movie, size_t frames){
+    if(frames <= movie->capacity){
+        return 0;
+    }
+    size_t capacity = movie->capacity > 0 ? movie->capacity : 1024;
+    while(capacity < frames){
+        capacity *= 2;
+    }
+    struct chip8_movie_frame *list = realloc(movie->frames, capacity * sizeof(struct chip8_movie_frame));
+    if(list == NULL){
+        return -1;
+    }
+    movie->frames = list;
+    /* One spare entry so that a movie shorter than the interval still gets an allocation */
+    uint64_t *checkpoints = realloc(movie->checkpoints,
+            (checkpoint_count(capacity, movie->header.checkpoint_interval) + 1) * sizeof(uint64_t));
+    if(checkpoints == NULL){
+        return -1;
+    }
+    movie->checkpoints = checkpoints;
+    movie->capacity = capacity;
+    return 0;
+}
+
+/*
+    Starts recording a machine that has just loaded its ROM, and seeds it
+    with seed. Hashes are taken every interval frames.
+*/
+struct chip8_movie *new_chip8_movie(struct chip8 *chip, unsigned int seed, int interval){
+    struct chip8_movie *movie = calloc(1, sizeof(struct chip8_movie));
+    if(movie == NULL){
+        perror("Movie allocation failed");
+        return NULL;
+    }
+    movie->header.magic = CHIP8_MOVIE_MAGIC;
+    movie->header.version = CHIP8_MOVIE_VERSION;
+    movie->header.checkpoint_interval = interval > 0 && interval <= 0xffff ? interval : CHIP8_MOVIE_CHECKPOINT_INTERVAL;
+    movie->header.seed = seed;
+    movie->header.instructions_per_frame = chip->instructions_per_frame;
+    movie->header.memory_hash = fnv1a(FNV_OFFSET_BASIS, chip->memory, sizeof(chip->memory));
+    if(reserve_frames(movie, 1) < 0){
+        perror("Movie allocation failed");
+        free_chip8_movie(movie);
+        return NULL;
+    }
+    seed_chip8(chip, seed);
+    return movie;
+}
+
+void free_chip8_movie(struct chip8_movie *movie){
+    free(movie->frames);
+    free(movie->checkpoints);
+    free(movie);
+}
+
+/* Appends the frame run_frame just finished. Returns -1 if the movie can not grow. */
+int movie_record_frame(struct chip8_movie *movie, const struct chip8 *chip){
+    size_t frame = movie->header.frames;
+    size_t interval = movie->header.checkpoint_interval;
+
+    if(frame == UINT32_MAX || reserve_frames(movie, frame + 1) < 0){
+        return -1;
+    }
+    movie->frames[frame].held = chip->keypad.polled_state;
+    movie->frames[frame].presses = chip->keypad.polled_presses;
+    movie->frames[frame].check = frame_check(chip);
+    if((frame + 1) % interval == 0){
+        movie->checkpoints[frame / interval] = hash_state(chip);
+    }
+    movie->header.frames = frame + 1;
+    return 0;
+}
+
+/* Forgets everything after the first frames frames, for rewinding during a recording */
+void movie_truncate(struct chip8_movie *movie, size_t frames){
+    if(frames < movie->header.frames){
+        movie->header.frames = frames;
+    }
+}
+
+int save_movie(const struct chip8_movie *movie, const char *path){
+    FILE *fd = fopen(path, "wb");
+    if(fd == NULL){
+        perror("Error opening the movie file");
+        return -1;
+    }
+    size_t frames = movie->header.frames;
+    size_t checkpoints = checkpoint_count(frames, movie->header.checkpoint_interval);
+    int ok = fwrite(&movie->header, sizeof(movie->header), 1, fd) == 1 &&
+            fwrite(movie->frames, sizeof(struct chip8_movie_frame), frames, fd) == frames &&
+            fwrite(movie->checkpoints, sizeof(uint64_t), checkpoints, fd) == checkpoints;
+    if(fclose(fd) != 0 || !ok){
+        perror("Error writing the movie file");
+        return -1;
+    }
+    return 0;
+}
+
+struct chip8_movie *load_movie(const char *path){
+    FILE *fd = fopen(path, "rb");
+    if(fd == NULL){
+        perror("Error opening the movie file");
+        return NULL;
+    }
+    struct chip8_movie *movie = calloc(1, sizeof(struct chip8_movie));
+    if(movie == NULL){
+        perror("Movie allocation failed");
+        fclose(fd);
+        return NULL;
+    }
+
+    if(fread(&movie->header, sizeof(movie->header), 1, fd) != 1 || movie->header.magic != CHIP8_MOVIE_MAGIC ||
+            movie->header.version != CHIP8_MOVIE_VERSION || movie->header.checkpoint_interval == 0){
+        fprintf(stderr, "%s is not a movie this version can play\n", path);
+        free_chip8_movie(movie);
+        fclose(fd);
+        return NULL;
+    }
+    size_t frames = movie->header.frames;
+    size_t checkpoints = checkpoint_count(frames, movie->header.checkpoint_interval);
+    if(reserve_frames(movie, frames > 0 ? frames : 1) < 0 ||
+            fread(movie->frames, sizeof(struct chip8_movie_frame), frames, fd) != frames ||
+            fread(movie->checkpoints, sizeof(uint64_t), checkpoints, fd) != checkpoints){
+        fprintf(stderr, "%s is truncated\n", path);
+        free_chip8_movie(movie);
+        fclose(fd);
+        return NULL;
+    }
+    fclose(fd);
+    return movie;
+}
+
+/*
+    Gets a machine that has just loaded its ROM ready to play the movie,
+    with the seed and instructions per frame it was recorded with. Returns -1 if the memory differs from the recording's, a different ROM.
+*/
+int start_movie(const struct chip8_movie *movie, struct chip8 *chip){
+    if(fnv1a(FNV_OFFSET_BASIS, chip->memory, sizeof(chip->memory)) != movie->header.memory_hash){
+        return -1;
+    }
+    seed_chip8(chip, movie->header.seed);
+    chip->instructions_per_frame = movie->header.instructions_per_frame != 0 ?
+            movie->header.instructions_per_frame : INSTRUCTIONS_PER_FRAME;
+    return 0;
+}
+
+/*
+    Plays the whole movie as fast as the core goes, on a machine prepared
+    by start_movie. Stops at the first frame whose check or checkpoint does
+    not match and stores it in frame, or the number of frames played when
+    the movie ends.
+*/
+enum movie_result replay_movie(const struct chip8_movie *movie, struct chip8 *chip, core_fn core, long *frame){
+    size_t interval = movie->header.checkpoint_interval;
+
+    for(size_t f = 0; f < movie->header.frames; f++){
+        set_keypad(chip, movie->frames[f].held, movie->frames[f].presses);
+        if(run_frame(chip, core) != 0){
+            *frame = f;
+            return MOVIE_FAULT;
+        }
+        if(frame_check(chip) != movie->frames[f].check ||
+                ((f + 1) % interval == 0 && hash_state(chip) != movie->checkpoints[f / interval])){
+            *frame = f;
+            return MOVIE_DESYNC;
+        }
+    }
+    *frame = movie->header.frames;
+    return MOVIE_MATCH;
+}
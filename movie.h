@@ -0,0 +1,75 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "decoder.h"
+
+#define CHIP8_MOVIE_VERSION 1
+#define CHIP8_MOVIE_MAGIC 0x564d3843u
+#define CHIP8_MOVIE_CHECKPOINT_INTERVAL 60
+
+/*
+    A movie file is a struct chip8_movie_header, then one struct
+    chip8_movie_frame per frame, then one state hash per checkpoint, all in
+    host byte order. Checkpoint i is hash_state() at the end of frame
+    (i + 1) * checkpoint_interval - 1.
+
+    A full hash costs more than a frame, so every frame also carries a
+    cheap check of the registers. Nearly every desync reaches them within
+    the frame it happens in, the checkpoints catch the ones that stay in
+    memory or on screen.
+
+    All the cores, the recompiler included, replay each other's movies.
+*/
+struct chip8_movie_header{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t checkpoint_interval;
+    uint32_t seed;
+    uint32_t frames;
+    /* Of the recording machine, 0 in movies from before it was configurable */
+    uint16_t instructions_per_frame;
+    uint16_t reserved;
+    /* FNV-1a of memory, fonts and ROM, when recording started */
+    uint64_t memory_hash;
+};
+
+/*
+    The keypad as poll_keys saw it at the start of the frame. Presses are
+    kept besides the held keys because a tap shorter than a frame only
+    shows up there, and Fx0A reads it.
+*/
+struct chip8_movie_frame{
+    uint16_t held;
+    uint16_t presses;
+    /* Of V0-VF, I, PC and the random generator at the end of the frame */
+    uint32_t check;
+};
+
+struct chip8_movie{
+    struct chip8_movie_header header;
+    struct chip8_movie_frame *frames;
+    uint64_t *checkpoints;
+    size_t capacity;
+};
+
+/* What replay_movie found */
+enum movie_result{
+    MOVIE_MATCH,
+    /* A check or checkpoint differed, at the frame replay_movie stores */
+    MOVIE_DESYNC,
+    /* The core stopped on an error */
+    MOVIE_FAULT
+};
+
+struct chip8_movie *new_chip8_movie(struct chip8 *, unsigned int, int);
+void free_chip8_movie(struct chip8_movie *);
+int movie_record_frame(struct chip8_movie *, const struct chip8 *);
+void movie_truncate(struct chip8_movie *, size_t);
+int save_movie(const struct chip8_movie *, const char *);
+struct chip8_movie *load_movie(const char *);
+int start_movie(const struct chip8_movie *, struct chip8 *);
+enum movie_result replay_movie(const struct chip8_movie *, struct chip8 *, core_fn, long *);
+
+#endif
@@ -0,0 +1,390 @@
+#include <string.h>
+#include "cpu.h"
+#include "jit.h"
+
+/*
+    Adapters between the uniform handler signature used by the decode cache
+    and the instruction implementations in cpu.c
+*/
+static int op_invalid(struct chip8 *chip, const struct decoded_instruction *d){
+    return -1;
+}
+
+static int op_cls(struct chip8 *chip, const struct decoded_instruction *d){
+    cls(chip);
+    return 0;
+}
+
+static int op_ret(struct chip8 *chip, const struct decoded_instruction *d){
+    ret(chip);
+    return 0;
+}
+
+static int op_jmp(struct chip8 *chip, const struct decoded_instruction *d){
+    jmp(chip, d->nnn);
+    return 0;
+}
+
+static int op_call(struct chip8 *chip, const struct decoded_instruction *d){
+    call(chip, d->nnn);
+    return 0;
+}
+
+static int op_iskip_on_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    iskip_on_equal(chip, d->x, d->kk);
+    return 0;
+}
+
+static int op_iskip_on_not_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    iskip_on_not_equal(chip, d->x, d->kk);
+    return 0;
+}
+
+static int op_skip_on_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    skip_on_equal(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_iload(struct chip8 *chip, const struct decoded_instruction *d){
+    iload(chip, d->x, d->kk);
+    return 0;
+}
+
+static int op_iadd(struct chip8 *chip, const struct decoded_instruction *d){
+    iadd(chip, d->x, d->kk);
+    return 0;
+}
+
+static int op_assign(struct chip8 *chip, const struct decoded_instruction *d){
+    assign(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_or(struct chip8 *chip, const struct decoded_instruction *d){
+    _or(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_and(struct chip8 *chip, const struct decoded_instruction *d){
+    _and(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_xor(struct chip8 *chip, const struct decoded_instruction *d){
+    _xor(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_add(struct chip8 *chip, const struct decoded_instruction *d){
+    add(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_sub(struct chip8 *chip, const struct decoded_instruction *d){
+    sub(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_shr(struct chip8 *chip, const struct decoded_instruction *d){
+    shr(chip, d->x);
+    return 0;
+}
+
+static int op_subn(struct chip8 *chip, const struct decoded_instruction *d){
+    subn(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_shl(struct chip8 *chip, const struct decoded_instruction *d){
+    shl(chip, d->x);
+    return 0;
+}
+
+static int op_skip_on_not_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    skip_on_not_equal(chip, d->x, d->y);
+    return 0;
+}
+
+static int op_set_index(struct chip8 *chip, const struct decoded_instruction *d){
+    set_index(chip, d->nnn);
+    return 0;
+}
+
+static int op_jmp_rel(struct chip8 *chip, const struct decoded_instruction *d){
+    jmp_rel(chip, d->nnn);
+    return 0;
+}
+
+static int op_set_rand(struct chip8 *chip, const struct decoded_instruction *d){
+    set_rand(chip, d->x, d->kk);
+    return 0;
+}
+
+static int op_display_sprite(struct chip8 *chip, const struct decoded_instruction *d){
+    display_sprite(chip, d->x, d->y, d->n);
+    return 0;
+}
+
+static int op_skip_pressed(struct chip8 *chip, const struct decoded_instruction *d){
+    skip_pressed(chip, d->x);
+    return 0;
+}
+
+static int op_skip_not_pressed(struct chip8 *chip, const struct decoded_instruction *d){
+    skip_not_pressed(chip, d->x);
+    return 0;
+}
+
+static int op_load_delay(struct chip8 *chip, const struct decoded_instruction *d){
+    load_delay(chip, d->x);
+    return 0;
+}
+
+static int op_wait_for_key(struct chip8 *chip, const struct decoded_instruction *d){
+    wait_for_key(chip, d->x);
+    return 1;
+}
+
+static int op_set_delay(struct chip8 *chip, const struct decoded_instruction *d){
+    set_delay(chip, d->x);
+    return 0;
+}
+
+static int op_set_sound(struct chip8 *chip, const struct decoded_instruction *d){
+    set_sound(chip, d->x);
+    return 0;
+}
+
+static int op_add_to_index(struct chip8 *chip, const struct decoded_instruction *d){
+    add_to_index(chip, d->x);
+    return 0;
+}
+
+static int op_load_location(struct chip8 *chip, const struct decoded_instruction *d){
+    load_location(chip, d->x);
+    return 0;
+}
+
+static int op_store_bcd(struct chip8 *chip, const struct decoded_instruction *d){
+    store_bcd(chip, d->x);
+    return 0;
+}
+
+static int op_store_registers(struct chip8 *chip, const struct decoded_instruction *d){
+    store_registers(chip, d->x);
+    return 0;
+}
+
+static int op_load_registers(struct chip8 *chip, const struct decoded_instruction *d){
+    load_registers(chip, d->x);
+    return 0;
+}
+
+static int op_iload_display_sprite(struct chip8 *chip, const struct decoded_instruction *d){
+    iload_display_sprite(chip, d->x, d->kk, d->x2, d->y2, d->n2);
+    COUNT_FUSION(chip, OP_ILOAD_DISPLAY_SPRITE);
+    return 0;
+}
+
+static int op_set_index_add_to_index(struct chip8 *chip, const struct decoded_instruction *d){
+    set_index_add_to_index(chip, d->nnn, d->x2);
+    COUNT_FUSION(chip, OP_SET_INDEX_ADD_TO_INDEX);
+    return 0;
+}
+
+static int op_iadd_iskip_on_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    iadd_iskip_on_equal(chip, d->x, d->kk, d->x2, d->kk2);
+    COUNT_FUSION(chip, OP_IADD_ISKIP_ON_EQUAL);
+    return 0;
+}
+
+static int op_load_delay_iskip_on_equal(struct chip8 *chip, const struct decoded_instruction *d){
+    load_delay_iskip_on_equal(chip, d->x, d->x2, d->kk2);
+    COUNT_FUSION(chip, OP_LOAD_DELAY_ISKIP_ON_EQUAL);
+    return 0;
+}
+
+/* Fx07, 3x00, 1nnn back to the Fx07: spins until the delay timer reaches 0 */
+static int op_wait_delay(struct chip8 *chip, const struct decoded_instruction *d){
+    load_delay(chip, d->x);
+    if(chip->delay_timer != 0){
+        /* The state after any number of iterations, until the timer changes */
+        chip->pc -= 2;
+        return 1;
+    }
+    /* Only the Fx07 ran, the 3x00 after it is an instruction of its own */
+    return 0;
+}
+
+/* 1nnn to itself, the ROM has halted */
+static int op_jmp_self(struct chip8 *chip, const struct decoded_instruction *d){
+    return 1;
+}
+
+static void set_kind(struct decoded_instruction *d, unsigned char op, instruction_handler handler){
+    d->op = op;
+    d->handler = handler;
+}
+
+/* Extracts the operands of an instruction and selects its handler */
+void predecode(struct decoded_instruction *d, unsigned short instruction){
+    d->nnn = instruction & 0x0fff;
+    d->x = (instruction & 0x0f00) >> 8;
+    d->y = (instruction & 0x00f0) >> 4;
+    d->n = instruction & 0x000f;
+    d->kk = instruction & 0x00ff;
+    set_kind(d, OP_INVALID, op_invalid);
+
+    switch((instruction & 0xf000) >> 12){
+        case 0x0: {
+            switch(instruction & 0x0fff){
+                case 0x00e0: set_kind(d, OP_CLS, op_cls); break;
+                case 0x00ee: set_kind(d, OP_RET, op_ret); break;
+            }
+            break;
+        }
+        case 0x1: set_kind(d, OP_JMP, op_jmp); break;
+        case 0x2: set_kind(d, OP_CALL, op_call); break;
+        case 0x3: set_kind(d, OP_ISKIP_ON_EQUAL, op_iskip_on_equal); break;
+        case 0x4: set_kind(d, OP_ISKIP_ON_NOT_EQUAL, op_iskip_on_not_equal); break;
+        case 0x5: set_kind(d, OP_SKIP_ON_EQUAL, op_skip_on_equal); break;
+        case 0x6: set_kind(d, OP_ILOAD, op_iload); break;
+        case 0x7: set_kind(d, OP_IADD, op_iadd); break;
+        case 0x8: {
+            switch(instruction & 0xf){
+                case 0x0: set_kind(d, OP_ASSIGN, op_assign); break;
+                case 0x1: set_kind(d, OP_OR, op_or); break;
+                case 0x2: set_kind(d, OP_AND, op_and); break;
+                case 0x3: set_kind(d, OP_XOR, op_xor); break;
+                case 0x4: set_kind(d, OP_ADD, op_add); break;
+                case 0x5: set_kind(d, OP_SUB, op_sub); break;
+                case 0x6: set_kind(d, OP_SHR, op_shr); break;
+                case 0x7: set_kind(d, OP_SUBN, op_subn); break;
+                case 0xe: set_kind(d, OP_SHL, op_shl); break;
+            }
+            break;
+        }
+        case 0x9: set_kind(d, OP_SKIP_ON_NOT_EQUAL, op_skip_on_not_equal); break;
+        case 0xA: set_kind(d, OP_SET_INDEX, op_set_index); break;
+        case 0xB: set_kind(d, OP_JMP_REL, op_jmp_rel); break;
+        case 0xC: set_kind(d, OP_SET_RAND, op_set_rand); break;
+        case 0xD: set_kind(d, OP_DISPLAY_SPRITE, op_display_sprite); break;
+        case 0xE: {
+            switch(instruction & 0xff){
+                case 0x9e: set_kind(d, OP_SKIP_PRESSED, op_skip_pressed); break;
+                case 0xa1: set_kind(d, OP_SKIP_NOT_PRESSED, op_skip_not_pressed); break;
+            }
+            break;
+        }
+        case 0xF: {
+            switch(instruction & 0xff){
+                case 0x07: set_kind(d, OP_LOAD_DELAY, op_load_delay); break;
+                case 0x0a: set_kind(d, OP_WAIT_FOR_KEY, op_wait_for_key); break;
+                case 0x15: set_kind(d, OP_SET_DELAY, op_set_delay); break;
+                case 0x18: set_kind(d, OP_SET_SOUND, op_set_sound); break;
+                case 0x1e: set_kind(d, OP_ADD_TO_INDEX, op_add_to_index); break;
+                case 0x29: set_kind(d, OP_LOAD_LOCATION, op_load_location); break;
+                case 0x33: set_kind(d, OP_STORE_BCD, op_store_bcd); break;
+                case 0x55: set_kind(d, OP_STORE_REGISTERS, op_store_registers); break;
+                case 0x65: set_kind(d, OP_LOAD_REGISTERS, op_load_registers); break;
+            }
+            break;
+        }
+    }
+}
+
+/*
+    Merges an instruction with the one following it when the pair is one of
+    the superinstructions implemented in cpu.c
+*/
+static void fuse(struct decoded_instruction *d, const struct decoded_instruction *next){
+    if(d->op == OP_ILOAD && next->op == OP_DISPLAY_SPRITE){
+        set_kind(d, OP_ILOAD_DISPLAY_SPRITE, op_iload_display_sprite);
+    }else if(d->op == OP_SET_INDEX && next->op == OP_ADD_TO_INDEX){
+        set_kind(d, OP_SET_INDEX_ADD_TO_INDEX, op_set_index_add_to_index);
+    }else if(d->op == OP_IADD && next->op == OP_ISKIP_ON_EQUAL){
+        set_kind(d, OP_IADD_ISKIP_ON_EQUAL, op_iadd_iskip_on_equal);
+    }else if(d->op == OP_LOAD_DELAY && next->op == OP_ISKIP_ON_EQUAL){
+        set_kind(d, OP_LOAD_DELAY_ISKIP_ON_EQUAL, op_load_delay_iskip_on_equal);
+    }else{
+        return;
+    }
+    d->x2 = next->x;
+    d->y2 = next->y;
+    d->n2 = next->n;
+    d->kk2 = next->kk;
+}
+
+static unsigned short instruction_at(const struct chip8 *chip, unsigned short address){
+    if(address >= 0x1000 - 1){
+        return 0;
+    }
+    return chip->memory[address] << 8 | chip->memory[address + 1];
+}
+
+/*
+    Recognizes loops that cannot make progress before the next timer tick,
+    given the two instructions following the one at address. Returns 1 if
+    the entry was turned into one of the idle loop kinds.
+*/
+int detect_idle_loop(struct decoded_instruction *d, unsigned short address,
+        unsigned short poll, unsigned short loop){
+    if(d->op == OP_JMP && d->nnn == address){
+        set_kind(d, OP_JMP_SELF, op_jmp_self);
+        return 1;
+    }
+    if(d->op == OP_LOAD_DELAY && poll == (0x3000 | d->x << 8) && loop == (0x1000 | address)){
+        set_kind(d, OP_WAIT_DELAY, op_wait_delay);
+        return 1;
+    }
+    return 0;
+}
+
+/* Fills a decode cache entry for the instruction at an even address */
+void predecode_at(struct chip8 *chip, struct decoded_instruction *d, unsigned short address){
+    predecode(d, instruction_at(chip, address));
+    if(chip->idle_detection &&
+            detect_idle_loop(d, address, instruction_at(chip, address + 2), instruction_at(chip, address + 4))){
+        return;
+    }
+    if(chip->fusion_enabled && address + 2 < 0x1000 - 1){
+        struct decoded_instruction next;
+        predecode(&next, instruction_at(chip, address + 2));
+        fuse(d, &next);
+    }
+}
+
+/*
+    Drops the cached entries that depend on a memory address that was
+    written: its own, and the two before it, which may have been fused with
+    it or recognized as an idle loop ending at it
+*/
+void invalidate_decoded(struct chip8 *chip, unsigned short address){
+    unsigned short entry = (address & 0xfff) >> 1;
+    for(int i = 0; i <= 2 && i <= entry; i++){
+        chip->decode_cache[entry - i].handler = NULL;
+    }
+    if(chip->jit != NULL){
+        jit_invalidate(chip->jit, address);
+    }
+}
+
+void invalidate_decode_cache(struct chip8 *chip){
+    memset(chip->decode_cache, 0, sizeof(chip->decode_cache));
+    if(chip->jit != NULL){
+        jit_flush(chip->jit);
+    }
+}
+
+void print_fusion_stats(FILE *out, const struct chip8 *chip){
+    static const char *const names[FUSED_OP_COUNT] = {
+        [OP_ILOAD_DISPLAY_SPRITE - FIRST_FUSED_OP] = "6xkk+Dxyn",
+        [OP_SET_INDEX_ADD_TO_INDEX - FIRST_FUSED_OP] = "Annn+Fx1E",
+        [OP_IADD_ISKIP_ON_EQUAL - FIRST_FUSED_OP] = "7xkk+3xkk",
+        [OP_LOAD_DELAY_ISKIP_ON_EQUAL - FIRST_FUSED_OP] = "Fx07+3xkk",
+    };
+    fprintf(out, "Fused pairs executed:\n");
+    for(int i = 0; i < FUSED_OP_COUNT; i++){
+        fprintf(out, "    %s: %lu\n", names[i], chip->fusion_counts[i]);
+    }
+}
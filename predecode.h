@@ -0,0 +1,114 @@
+#ifndef PREDECODE_H
+#define PREDECODE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One entry for every even address of the 4kB address space */
+#define DECODE_CACHE_SIZE (4096 / 2)
+
+struct chip8;
+struct decoded_instruction;
+
+/* Instruction kinds, the threaded core uses them to index its label table */
+enum instruction_kind{
+    OP_INVALID,
+    OP_CLS,
+    OP_RET,
+    OP_JMP,
+    OP_CALL,
+    OP_ISKIP_ON_EQUAL,
+    OP_ISKIP_ON_NOT_EQUAL,
+    OP_SKIP_ON_EQUAL,
+    OP_ILOAD,
+    OP_IADD,
+    OP_ASSIGN,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD,
+    OP_SUB,
+    OP_SHR,
+    OP_SUBN,
+    OP_SHL,
+    OP_SKIP_ON_NOT_EQUAL,
+    OP_SET_INDEX,
+    OP_JMP_REL,
+    OP_SET_RAND,
+    OP_DISPLAY_SPRITE,
+    OP_SKIP_PRESSED,
+    OP_SKIP_NOT_PRESSED,
+    OP_LOAD_DELAY,
+    OP_WAIT_FOR_KEY,
+    OP_SET_DELAY,
+    OP_SET_SOUND,
+    OP_ADD_TO_INDEX,
+    OP_LOAD_LOCATION,
+    OP_STORE_BCD,
+    OP_STORE_REGISTERS,
+    OP_LOAD_REGISTERS,
+    /* Superinstructions, the second instruction's operands are in x2/y2/n2/kk2 */
+    OP_ILOAD_DISPLAY_SPRITE,
+    OP_SET_INDEX_ADD_TO_INDEX,
+    OP_IADD_ISKIP_ON_EQUAL,
+    OP_LOAD_DELAY_ISKIP_ON_EQUAL,
+    /* Idle loops, they end the current frame early */
+    OP_WAIT_DELAY,
+    OP_JMP_SELF,
+    OP_COUNT
+};
+
+#define FIRST_FUSED_OP OP_ILOAD_DISPLAY_SPRITE
+#define FUSED_OP_COUNT (OP_WAIT_DELAY - FIRST_FUSED_OP)
+/* Superinstructions stand for two instructions of the budget */
+#define IS_FUSED_OP(op) ((op) >= FIRST_FUSED_OP && (op) < OP_WAIT_DELAY)
+
+/*
+    Counts a superinstruction for print_fusion_stats(). Only profiling
+    builds count, elsewhere a fused handler does no more than the pair.
+*/
+#ifdef CHIP8_PROFILE
+#define COUNT_FUSION(chip, op) ((chip)->fusion_counts[(op) - FIRST_FUSED_OP]++)
+#else
+#define COUNT_FUSION(chip, op) ((void)0)
+#endif
+
+/*
+    Returns 0 on success, -1 if the instruction is invalid and 1 if nothing
+    will happen until the next timer tick
+*/
+typedef int (*instruction_handler)(struct chip8 *, const struct decoded_instruction *);
+
+/*
+    An instruction with its operands already extracted. An entry with a NULL
+    handler has not been decoded yet.
+*/
+struct decoded_instruction{
+    instruction_handler handler;
+    unsigned short nnn;
+    unsigned char op;
+    unsigned char x;
+    unsigned char y;
+    unsigned char n;
+    unsigned char kk;
+    unsigned char x2;
+    unsigned char y2;
+    unsigned char n2;
+    unsigned char kk2;
+};
+
+void predecode(struct decoded_instruction *, unsigned short);
+int detect_idle_loop(struct decoded_instruction *, unsigned short, unsigned short, unsigned short);
+void predecode_at(struct chip8 *, struct decoded_instruction *, unsigned short);
+void invalidate_decoded(struct chip8 *, unsigned short);
+void invalidate_decode_cache(struct chip8 *);
+void print_fusion_stats(FILE *, const struct chip8 *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
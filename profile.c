@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "profile.h"
+
+/* Encoding of every instruction kind, the first digit is its class */
+static const char *const kind_names[OP_COUNT] = {
+    [OP_INVALID] = "invalid",
+    [OP_CLS] = "00E0",
+    [OP_RET] = "00EE",
+    [OP_JMP] = "1nnn",
+    [OP_CALL] = "2nnn",
+    [OP_ISKIP_ON_EQUAL] = "3xkk",
+    [OP_ISKIP_ON_NOT_EQUAL] = "4xkk",
+    [OP_SKIP_ON_EQUAL] = "5xy0",
+    [OP_ILOAD] = "6xkk",
+    [OP_IADD] = "7xkk",
+    [OP_ASSIGN] = "8xy0",
+    [OP_OR] = "8xy1",
+    [OP_AND] = "8xy2",
+    [OP_XOR] = "8xy3",
+    [OP_ADD] = "8xy4",
+    [OP_SUB] = "8xy5",
+    [OP_SHR] = "8xy6",
+    [OP_SUBN] = "8xy7",
+    [OP_SHL] = "8xyE",
+    [OP_SKIP_ON_NOT_EQUAL] = "9xy0",
+    [OP_SET_INDEX] = "Annn",
+    [OP_JMP_REL] = "Bnnn",
+    [OP_SET_RAND] = "Cxkk",
+    [OP_DISPLAY_SPRITE] = "Dxyn",
+    [OP_SKIP_PRESSED] = "Ex9E",
+    [OP_SKIP_NOT_PRESSED] = "ExA1",
+    [OP_LOAD_DELAY] = "Fx07",
+    [OP_WAIT_FOR_KEY] = "Fx0A",
+    [OP_SET_DELAY] = "Fx15",
+    [OP_SET_SOUND] = "Fx18",
+    [OP_ADD_TO_INDEX] = "Fx1E",
+    [OP_LOAD_LOCATION] = "Fx29",
+    [OP_STORE_BCD] = "Fx33",
+    [OP_STORE_REGISTERS] = "Fx55",
+    [OP_LOAD_REGISTERS] = "Fx65",
+    [OP_ILOAD_DISPLAY_SPRITE] = "6xkk+Dxyn",
+    [OP_SET_INDEX_ADD_TO_INDEX] = "Annn+Fx1E",
+    [OP_IADD_ISKIP_ON_EQUAL] = "7xkk+3xkk",
+    [OP_LOAD_DELAY_ISKIP_ON_EQUAL] = "Fx07+3xkk",
+    [OP_WAIT_DELAY] = "Fx07+3x00+1nnn",
+    [OP_JMP_SELF] = "1nnn-self",
+};
+
+/* The class digit of a kind, ? for invalid instructions */
+static char kind_class(int kind){
+    return kind == OP_INVALID ? '?' : kind_names[kind][0];
+}
+
+static int is_skip(int kind){
+    switch(kind){
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL:
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL:
+        case OP_SKIP_PRESSED:
+        case OP_SKIP_NOT_PRESSED:
+        case OP_IADD_ISKIP_ON_EQUAL:
+        case OP_LOAD_DELAY_ISKIP_ON_EQUAL: {
+            return 1;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+struct chip8_profile *new_chip8_profile(void){
+    struct chip8_profile *profile = calloc(1, sizeof(struct chip8_profile));
+    if(profile == NULL){
+        perror("Profile allocation failed");
+    }
+    return profile;
+}
+
+void free_chip8_profile(struct chip8_profile *profile){
+    free(profile);
+}
+
+/*
+    Writes the counters as one JSON object: per kind, per class (the first
+    hex digit of the encoding) and per address that ran at least once.
+    cycles are time stamp counter ticks where there is one, nanoseconds
+    elsewhere.
+*/
+int write_profile_json(const struct chip8_profile *profile, FILE *out){
+    static const char classes[] = "0123456789ABCDEF?";
+    const char *separator = "";
+
+    fprintf(out, "{\n  \"kinds\": [");
+    for(int kind = 0; kind < OP_COUNT; kind++){
+        if(profile->executed[kind] == 0){
+            continue;
+        }
+        fprintf(out, "%s\n    {\"kind\": \"%s\", \"class\": \"%c\", \"executed\": %llu, \"cycles\": %llu",
+                separator, kind_names[kind], kind_class(kind),
+                (unsigned long long)profile->executed[kind], (unsigned long long)profile->cycles[kind]);
+        if(is_skip(kind)){
+            fprintf(out, ", \"taken\": %llu, \"taken_rate\": %.4f", (unsigned long long)profile->taken[kind],
+                    (double)profile->taken[kind] / profile->executed[kind]);
+        }
+        fprintf(out, "}");
+        separator = ",";
+    }
+
+    fprintf(out, "\n  ],\n  \"classes\": [");
+    separator = "";
+    for(const char *c = classes; *c != '\0'; c++){
+        uint64_t executed = 0, cycles = 0;
+        for(int kind = 0; kind < OP_COUNT; kind++){
+            if(kind_class(kind) == *c){
+                executed += profile->executed[kind];
+                cycles += profile->cycles[kind];
+            }
+        }
+        if(executed == 0){
+            continue;
+        }
+        fprintf(out, "%s\n    {\"class\": \"%c\", \"executed\": %llu, \"cycles\": %llu}", separator, *c,
+                (unsigned long long)executed, (unsigned long long)cycles);
+        separator = ",";
+    }
+
+    fprintf(out, "\n  ],\n  \"addresses\": [");
+    separator = "";
+    for(int pc = 0; pc < 4096; pc++){
+        if(profile->pc_hits[pc] == 0){
+            continue;
+        }
+        fprintf(out, "%s\n    {\"pc\": \"0x%03x\", \"kind\": \"%s\", \"hits\": %llu, \"cycles\": %llu}", separator, pc,
+                kind_names[profile->pc_kind[pc]], (unsigned long long)profile->pc_hits[pc],
+                (unsigned long long)profile->pc_cycles[pc]);
+        separator = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+    Writes one folded stack per address, decode;class;kind;address followed
+    by its cycles, the input flamegraph.pl and speedscope take
+*/
+int write_profile_folded(const struct chip8_profile *profile, FILE *out){
+    for(int pc = 0; pc < 4096; pc++){
+        if(profile->pc_hits[pc] == 0){
+            continue;
+        }
+        int kind = profile->pc_kind[pc];
+        fprintf(out, "decode;%cxxx;%s;0x%03x %llu\n", kind_class(kind), kind_names[kind], pc,
+                (unsigned long long)profile->pc_cycles[pc]);
+    }
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,85 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "predecode.h"
+
+/*
+    Execution profile of decode(), filled in only by builds with
+    CHIP8_PROFILE defined (make PROFILE=1) and only for machines whose
+    profile pointer is set. Other builds do not compile the counting in.
+*/
+struct chip8_profile{
+    /* Per instruction kind, superinstructions and idle loops included */
+    uint64_t executed[OP_COUNT];
+    uint64_t cycles[OP_COUNT];
+    /* For the skips, how often the next instruction was skipped */
+    uint64_t taken[OP_COUNT];
+    /* Per address */
+    uint64_t pc_hits[4096];
+    uint64_t pc_cycles[4096];
+    /* The kind last executed at each address */
+    unsigned char pc_kind[4096];
+};
+
+#ifdef CHIP8_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+/* Time stamp counter ticks, a few cycles to read */
+static inline uint64_t profile_clock(void){
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline uint64_t profile_clock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+#endif
+
+/* Whether kind may skip the instruction after it, and over how many bytes it normally moves the PC */
+static inline int profile_skip_width(unsigned char kind){
+    switch(kind){
+        case OP_ISKIP_ON_EQUAL:
+        case OP_ISKIP_ON_NOT_EQUAL:
+        case OP_SKIP_ON_EQUAL:
+        case OP_SKIP_ON_NOT_EQUAL:
+        case OP_SKIP_PRESSED:
+        case OP_SKIP_NOT_PRESSED: {
+            return 2;
+        }
+        case OP_IADD_ISKIP_ON_EQUAL:
+        case OP_LOAD_DELAY_ISKIP_ON_EQUAL: {
+            return 4;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+/* Accounts one dispatch of kind at pc, which left the PC at next_pc */
+static inline void profile_instruction(struct chip8_profile *profile, unsigned char kind,
+        unsigned short pc, unsigned short next_pc, uint64_t cycles){
+    profile->executed[kind]++;
+    profile->cycles[kind] += cycles;
+    profile->pc_hits[pc & 0xfff]++;
+    profile->pc_cycles[pc & 0xfff] += cycles;
+    profile->pc_kind[pc & 0xfff] = kind;
+    int width = profile_skip_width(kind);
+    if(width != 0 && next_pc == pc + width + 2){
+        profile->taken[kind]++;
+    }
+}
+#endif
+
+struct chip8_profile *new_chip8_profile(void);
+void free_chip8_profile(struct chip8_profile *);
+int write_profile_json(const struct chip8_profile *, FILE *);
+int write_profile_folded(const struct chip8_profile *, FILE *);
+
+#endif
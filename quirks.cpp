@@ -0,0 +1,222 @@
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include "cpu.h"
+#include "decoder.h"
+#include "quirks.h"
+
+/*
+    Interpreter core specialised at compile time for a set of quirks. Each
+    of the 2^CHIP8_QUIRK_COUNT combinations is its own instantiation of
+    run_quirks, where every test of a quirk is an if constexpr, so the
+    loop of a given variant holds only the code of its behaviours and no
+    branch on the quirks is left at run time. quirks_core() returns the
+    instantiation for a set of quirks as an ordinary core_fn.
+
+    The variants run on the decode cache like decode() does, with the same
+    idle loops and superinstructions and the same instruction counts, and
+    only the instructions a quirk changes leave the cached handlers. With no
+    quirks set the loop is decode() without its fuzzing and profiling hooks,
+    so it ends in the same states. Any quirk changes the state hashes of the
+    ROMs that run into it.
+*/
+
+namespace {
+
+/* 8xy6 and 8xyE */
+template<unsigned int Quirks>
+inline void shift(struct chip8 *chip, unsigned short x, unsigned short y, bool left){
+    if constexpr((Quirks & CHIP8_QUIRK_SHIFT_VY) != 0){
+        unsigned char value = chip->registers[y];
+        chip->registers[x] = left ? value << 1 : value >> 1;
+        chip->registers[0xf] = left ? value >> 7 : value & 1;
+        chip->pc += 2;
+    }else if(left){
+        shl(chip, x);
+    }else{
+        shr(chip, x);
+    }
+}
+
+/* 8xy1, 8xy2 and 8xy3, after the handler has run */
+template<unsigned int Quirks>
+inline void logic_flag(struct chip8 *chip){
+    if constexpr((Quirks & CHIP8_QUIRK_VF_RESET) != 0){
+        chip->registers[0xf] = 0;
+    }
+}
+
+/* Bnnn, or Bxnn */
+template<unsigned int Quirks>
+inline void jump_offset(struct chip8 *chip, unsigned short nnn){
+    if constexpr((Quirks & CHIP8_QUIRK_JUMP_VX) != 0){
+        chip->pc = nnn + chip->registers[nnn >> 8];
+    }else{
+        jmp_rel(chip, nnn);
+    }
+}
+
+/* Fx55 and Fx65, after the handler has run */
+template<unsigned int Quirks>
+inline void advance_index(struct chip8 *chip, unsigned short x){
+    if constexpr((Quirks & CHIP8_QUIRK_INDEX_INCREMENT) != 0){
+        chip->index_register += x + 1;
+    }
+}
+
+/*
+    Dxyn. Clipped sprites still start at Vx mod 64, Vy mod 32, only the
+    pixels past the right and bottom edges are dropped.
+*/
+template<unsigned int Quirks>
+inline void draw(struct chip8 *chip, unsigned short x, unsigned short y, unsigned short n){
+    if constexpr((Quirks & CHIP8_QUIRK_SPRITE_CLIP) != 0){
+        unsigned char x_pos = chip->registers[x] % DISPLAY_WIDTH;
+        unsigned char y_pos = chip->registers[y] % DISPLAY_HEIGTH;
+        uint64_t erased = 0;
+
+        for(unsigned short i = 0; i < n && y_pos + i < DISPLAY_HEIGTH; i++){
+            /* Bits shifted out on the right are the clipped pixels */
+            uint64_t sprite_row = ((uint64_t)chip->memory[(chip->index_register + i) & 0xfff] << 56) >> x_pos;
+            uint64_t *row = &chip->display_memory[y_pos + i];
+            erased |= *row & sprite_row;
+            *row ^= sprite_row;
+            if(sprite_row){
+                chip->dirty_rows |= 1u << (y_pos + i);
+            }
+        }
+        chip->registers[0xf] = erased != 0;
+        chip->pc += 2;
+    }else{
+        display_sprite(chip, x, y, n);
+    }
+}
+
+/*
+    One decode cache entry with the quirks applied. The instructions the
+    variants agree on, idle loops and superinstructions without a quirk
+    in them go to the entry's handler, as in decode().
+*/
+template<unsigned int Quirks>
+inline int step(struct chip8 *chip, const struct decoded_instruction *d){
+    if constexpr(Quirks == 0){
+        return d->handler(chip, d);
+    }
+    switch(d->op){
+        case OP_OR: _or(chip, d->x, d->y); logic_flag<Quirks>(chip); return 0;
+        case OP_AND: _and(chip, d->x, d->y); logic_flag<Quirks>(chip); return 0;
+        case OP_XOR: _xor(chip, d->x, d->y); logic_flag<Quirks>(chip); return 0;
+        case OP_SHR: shift<Quirks>(chip, d->x, d->y, false); return 0;
+        case OP_SHL: shift<Quirks>(chip, d->x, d->y, true); return 0;
+        case OP_JMP_REL: jump_offset<Quirks>(chip, d->nnn); return 0;
+        case OP_DISPLAY_SPRITE: draw<Quirks>(chip, d->x, d->y, d->n); return 0;
+        case OP_ILOAD_DISPLAY_SPRITE: {
+            iload(chip, d->x, d->kk);
+            draw<Quirks>(chip, d->x2, d->y2, d->n2);
+            COUNT_FUSION(chip, OP_ILOAD_DISPLAY_SPRITE);
+            return 0;
+        }
+        case OP_STORE_REGISTERS: store_registers(chip, d->x); advance_index<Quirks>(chip, d->x); return 0;
+        case OP_LOAD_REGISTERS: load_registers(chip, d->x); advance_index<Quirks>(chip, d->x); return 0;
+        default: return d->handler(chip, d);
+    }
+}
+
+/* Same contract as decode(): at most budget instructions, -1 on an invalid one */
+template<unsigned int Quirks>
+long run_quirks(struct chip8 *chip, long budget){
+    long executed = 0;
+
+    while(executed < budget){
+        if(chip->pc >= 0x1000 - 1){
+            perror("Invalid memory address\n");
+            return -1;
+        }
+        executed++;
+        /* Odd addresses are not cached, they are decoded on the spot */
+        struct decoded_instruction uncached;
+        struct decoded_instruction *d = &uncached;
+        if(chip->pc & 1){
+            predecode(d, fetch(chip));
+        }else{
+            d = &chip->decode_cache[chip->pc >> 1];
+            if(d->handler == NULL){
+                predecode_at(chip, d, chip->pc);
+            }
+            if(IS_FUSED_OP(d->op)){
+                if(executed < budget){
+                    executed++;
+                }else{
+                    /* One instruction of budget left, only the first half of the pair runs */
+                    d = &uncached;
+                    predecode(d, fetch(chip));
+                }
+            }
+        }
+
+        int status = step<Quirks>(chip, d);
+        if(status < 0){
+            perror("Invalid instruction\n");
+            return -1;
+        }
+        if(status > 0){
+            break;
+        }
+    }
+    return executed;
+}
+
+/* One entry per combination of quirks, indexed by the combination */
+template<unsigned int... Quirks>
+constexpr auto make_cores(std::integer_sequence<unsigned int, Quirks...>){
+    return std::array<core_fn, sizeof...(Quirks)>{run_quirks<Quirks>...};
+}
+
+constexpr auto cores = make_cores(std::make_integer_sequence<unsigned int, 1u << CHIP8_QUIRK_COUNT>());
+
+}
+
+/* The core for a combination of CHIP8_QUIRK_* bits, unknown bits are ignored */
+extern "C" core_fn quirks_core(unsigned int quirks){
+    return cores[quirks & ((1u << CHIP8_QUIRK_COUNT) - 1)];
+}
+
+/*
+    Parses a comma separated list of quirk names, or vip or schip for the
+    usual sets. Returns -1 on a name it does not know.
+*/
+extern "C" int parse_quirks(const char *text, unsigned int *quirks){
+    static const struct{
+        const char *name;
+        unsigned int quirks;
+    } names[] = {
+        {"shift", CHIP8_QUIRK_SHIFT_VY},
+        {"index", CHIP8_QUIRK_INDEX_INCREMENT},
+        {"jump", CHIP8_QUIRK_JUMP_VX},
+        {"clip", CHIP8_QUIRK_SPRITE_CLIP},
+        {"vfreset", CHIP8_QUIRK_VF_RESET},
+        {"vip", CHIP8_QUIRKS_VIP},
+        {"schip", CHIP8_QUIRKS_SCHIP},
+        {"none", 0},
+    };
+
+    *quirks = 0;
+    while(*text != '\0'){
+        size_t length = strcspn(text, ",");
+        size_t i = 0;
+        while(i < sizeof(names) / sizeof(names[0]) &&
+                (strlen(names[i].name) != length || strncmp(names[i].name, text, length) != 0)){
+            i++;
+        }
+        if(i == sizeof(names) / sizeof(names[0])){
+            return -1;
+        }
+        *quirks |= names[i].quirks;
+        text += length;
+        if(*text == ','){
+            text++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include "decoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Behaviours the CHIP-8 variants disagree on. With none set the machine
+    behaves like the C cores. Each set bit picks the other behaviour.
+*/
+/* 8xy6/8xyE shift Vy into Vx, as on the COSMAC VIP, instead of shifting Vx in place */
+#define CHIP8_QUIRK_SHIFT_VY (1u << 0)
+/* Fx55/Fx65 leave I pointing past the last register, as on the COSMAC VIP */
+#define CHIP8_QUIRK_INDEX_INCREMENT (1u << 1)
+/* Bnnn is Bxnn and jumps to xnn + Vx, as on the CHIP-48 and SUPER-CHIP */
+#define CHIP8_QUIRK_JUMP_VX (1u << 2)
+/* Sprites are cut off at the edges of the screen instead of wrapping around */
+#define CHIP8_QUIRK_SPRITE_CLIP (1u << 3)
+/* 8xy1/8xy2/8xy3 clear VF, as on the COSMAC VIP */
+#define CHIP8_QUIRK_VF_RESET (1u << 4)
+#define CHIP8_QUIRK_COUNT 5
+
+#define CHIP8_QUIRKS_VIP (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_INDEX_INCREMENT | CHIP8_QUIRK_SPRITE_CLIP | CHIP8_QUIRK_VF_RESET)
+#define CHIP8_QUIRKS_SCHIP (CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_SPRITE_CLIP)
+
+core_fn quirks_core(unsigned int);
+int parse_quirks(const char *, unsigned int *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "savestate.h"
+#include "rewind.h"
+
+/*
+    A delta is a sequence of runs: a 16 bit count of unchanged bytes, a 16
+    bit count of changed bytes, then the changed bytes XORed with the
+    keyframe. Unchanged bytes at the end are implied.
+*/
+#define RUN_HEADER 4
+/* Changed runs only end after this many unchanged bytes, shorter gaps cost less as literals */
+#define MIN_GAP RUN_HEADER
+
+static uint64_t load_word(const unsigned char *bytes){
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static void store_count(unsigned char *out, size_t count){
+    uint16_t value = count;
+    memcpy(out, &value, sizeof(value));
+}
+
+static size_t load_count(const unsigned char *in){
+    uint16_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+/* Returns the encoded size, which may exceed CHIP8_STATE_SIZE for states that changed a lot */
+static size_t encode_delta(const unsigned char *state, const unsigned char *keyframe, unsigned char *out){
+    size_t i = 0, size = 0;
+
+    while(i < CHIP8_STATE_SIZE){
+        size_t start = i;
+        /* Whole unchanged words first, that is where most of the state is */
+        while(i + sizeof(uint64_t) <= CHIP8_STATE_SIZE && load_word(state + i) == load_word(keyframe + i)){
+            i += sizeof(uint64_t);
+        }
+        while(i < CHIP8_STATE_SIZE && state[i] == keyframe[i]){
+            i++;
+        }
+        if(i == CHIP8_STATE_SIZE){
+            break;
+        }
+        size_t unchanged = i - start;
+
+        size_t literal = i, gap = 0;
+        while(i < CHIP8_STATE_SIZE && gap < MIN_GAP){
+            gap = state[i] == keyframe[i] ? gap + 1 : 0;
+            i++;
+        }
+        i -= gap;
+
+        store_count(out + size, unchanged);
+        store_count(out + size + 2, i - literal);
+        size += RUN_HEADER;
+        for(size_t j = literal; j < i; j++){
+            out[size++] = state[j] ^ keyframe[j];
+        }
+    }
+    return size;
+}
+
+static void decode_delta(const unsigned char *delta, size_t size, const unsigned char *keyframe, unsigned char *state){
+    size_t position = 0;
+
+    memcpy(state, keyframe, CHIP8_STATE_SIZE);
+    for(size_t i = 0; i < size;){
+        position += load_count(delta + i);
+        size_t changed = load_count(delta + i + 2);
+        i += RUN_HEADER;
+        for(size_t j = 0; j < changed; j++){
+            state[position++] ^= delta[i++];
+        }
+    }
+}
+
+/*
+    Keeps up to frames snapshots in bytes of buffer space, with a keyframe
+    every keyframe_interval frames
+*/
+struct rewind *new_rewind(size_t bytes, size_t frames, int keyframe_interval){
+    struct rewind *rewind = calloc(1, sizeof(struct rewind));
+    if(rewind == NULL){
+        perror("Rewind buffer allocation failed");
+        return NULL;
+    }
+    rewind->buffer = malloc(bytes);
+    rewind->entries = malloc(frames * sizeof(struct rewind_entry));
+    rewind->keyframe = malloc(CHIP8_STATE_SIZE);
+    /* Room for the worst case delta, one run header per changed byte and gap */
+    rewind->scratch = malloc(CHIP8_STATE_SIZE * (RUN_HEADER + 1));
+    if(rewind->buffer == NULL || rewind->entries == NULL || rewind->keyframe == NULL ||
+            rewind->scratch == NULL || bytes < CHIP8_STATE_SIZE || frames < 2){
+        perror("Rewind buffer allocation failed");
+        free_rewind(rewind);
+        return NULL;
+    }
+    rewind->capacity = bytes;
+    rewind->max_entries = frames;
+    rewind->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    return rewind;
+}
+
+void free_rewind(struct rewind *rewind){
+    free(rewind->buffer);
+    free(rewind->entries);
+    free(rewind->keyframe);
+    free(rewind->scratch);
+    free(rewind);
+}
+
+size_t rewind_frames(const struct rewind *rewind){
+    return rewind->count;
+}
+
+static struct rewind_entry *entry(struct rewind *rewind, size_t index){
+    return &rewind->entries[(rewind->first + index) % rewind->max_entries];
+}
+
+/* Drops the oldest keyframe and the deltas that depend on it */
+static void drop_oldest(struct rewind *rewind){
+    do{
+        rewind->first = (rewind->first + 1) % rewind->max_entries;
+        rewind->count--;
+    }while(rewind->count > 0 && !entry(rewind, 0)->keyframe);
+}
+
+/* Whether [offset, offset + size) overlaps a live snapshot */
+static int in_use(struct rewind *rewind, size_t offset, size_t size){
+    if(rewind->count == 0){
+        return 0;
+    }
+    /* Snapshots are written in order, so the live bytes are one circular range */
+    size_t start = entry(rewind, 0)->offset;
+    size_t end = rewind->write_offset;
+    if(start < end){
+        return offset < end && offset + size > start;
+    }
+    return offset < end || offset + size > start;
+}
+
+/* Finds room for a snapshot, dropping old ones as needed, and returns its offset */
+static size_t reserve(struct rewind *rewind, size_t size){
+    size_t offset = rewind->write_offset;
+    if(offset + size > rewind->capacity){
+        /* Snapshots never wrap, the tail of the buffer is left unused */
+        while(rewind->count > 0 && entry(rewind, 0)->offset >= offset){
+            drop_oldest(rewind);
+        }
+        offset = 0;
+    }
+    while(rewind->count == rewind->max_entries || in_use(rewind, offset, size)){
+        drop_oldest(rewind);
+    }
+    if(rewind->count == 0){
+        offset = 0;
+    }
+    rewind->write_offset = offset + size;
+    return offset;
+}
+
+/* Records the state at the end of a frame */
+void rewind_push(struct rewind *rewind, const struct chip8 *chip){
+    const unsigned char *state = (const unsigned char *)chip;
+    const unsigned char *data = state;
+    size_t size = CHIP8_STATE_SIZE;
+    int keyframe = rewind->count == 0 || rewind->since_keyframe + 1 >= rewind->keyframe_interval;
+
+    if(!keyframe){
+        size_t delta = encode_delta(state, rewind->keyframe, rewind->scratch);
+        if(delta < CHIP8_STATE_SIZE){
+            data = rewind->scratch;
+            size = delta;
+        }else{
+            /* Not worth a delta, start a new group */
+            keyframe = 1;
+        }
+    }
+
+    size_t offset = reserve(rewind, size);
+    if(!keyframe && rewind->count == 0){
+        /* Making room dropped the keyframe this delta was taken against */
+        keyframe = 1;
+        data = state;
+        size = CHIP8_STATE_SIZE;
+        offset = reserve(rewind, size);
+    }
+    memcpy(rewind->buffer + offset, data, size);
+
+    struct rewind_entry *e = entry(rewind, rewind->count);
+    e->offset = offset;
+    e->size = size;
+    e->keyframe = keyframe;
+    rewind->count++;
+
+    if(keyframe){
+        memcpy(rewind->keyframe, state, CHIP8_STATE_SIZE);
+        rewind->since_keyframe = 0;
+    }else{
+        rewind->since_keyframe++;
+    }
+}
+
+/*
+    Drops the newest snapshot and restores the one before it, which becomes
+    the newest. Returns -1 if there is nothing older to go back to.
+*/
+int rewind_step_back(struct rewind *rewind, struct chip8 *chip){
+    if(rewind->count < 2){
+        return -1;
+    }
+    rewind->count--;
+    struct rewind_entry *newest = entry(rewind, rewind->count - 1);
+    rewind->write_offset = newest->offset + newest->size;
+
+    /* Deltas are relative to the keyframe that opens their group */
+    size_t key = rewind->count - 1;
+    while(!entry(rewind, key)->keyframe){
+        key--;
+    }
+    struct rewind_entry *keyframe = entry(rewind, key);
+    memcpy(rewind->keyframe, rewind->buffer + keyframe->offset, CHIP8_STATE_SIZE);
+    rewind->since_keyframe = rewind->count - 1 - key;
+
+    if(newest->keyframe){
+        chip8_load_state_bytes(chip, rewind->keyframe);
+    }else{
+        decode_delta(rewind->buffer + newest->offset, newest->size, rewind->keyframe, rewind->scratch);
+        chip8_load_state_bytes(chip, rewind->scratch);
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct chip8;
+
+/*
+    One snapshot per frame. Keyframes hold the whole machine state, the
+    frames after them only the XOR of their state with the keyframe,
+    run-length encoded. The oldest keyframe and its deltas are dropped
+    together when the buffer is full.
+*/
+struct rewind_entry{
+    uint32_t offset;
+    uint16_t size;
+    uint8_t keyframe;
+};
+
+struct rewind{
+    unsigned char *buffer;
+    size_t capacity;
+    /* Where the next snapshot goes */
+    size_t write_offset;
+    struct rewind_entry *entries;
+    size_t max_entries;
+    /* Oldest entry, and how many are live */
+    size_t first;
+    size_t count;
+    int keyframe_interval;
+    /* Deltas written against the current keyframe */
+    int since_keyframe;
+    /* The state of the keyframe the next delta is taken against */
+    unsigned char *keyframe;
+    unsigned char *scratch;
+};
+
+struct rewind *new_rewind(size_t, size_t, int);
+void free_rewind(struct rewind *);
+void rewind_push(struct rewind *, const struct chip8 *);
+int rewind_step_back(struct rewind *, struct chip8 *);
+size_t rewind_frames(const struct rewind *);
+
+#endif
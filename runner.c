@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "hash.h"
+
+/*
+    chip8-batch: runs many short jobs in one process.
+
+    Usage: chip8-batch [-j threads] [-t] [-o results] manifest
+    -j number of worker threads, one per online CPU by default
+    -t selects the threaded interpreter core
+    -o where the results go, results.bin by default
+
+    Every manifest line is "rom input budget [seed]", lines starting with #
+    are skipped. input is a script of "frame keys" lines, keys being the hex
+    mask of the keys held from that frame on, or - for no input. budget is
+    the number of instructions to run.
+
+    The results file is a stream of struct result records in host byte
+    order, in the order jobs finish.
+*/
+
+/* Large enough for a machine, a ROM and a long input script */
+#define ARENA_SIZE (4 << 20)
+
+enum result_status{
+    RESULT_DONE,
+    /* The ROM jumped to itself before the budget ran out */
+    RESULT_HALTED,
+    /* Waiting on Fx0A with no input left */
+    RESULT_STALLED,
+    RESULT_FAULT,
+    /* The ROM, the input script or the arena gave out before the job started */
+    RESULT_ERROR
+};
+
+struct result{
+    uint32_t job;
+    uint32_t status;
+    uint64_t cycles;
+    uint64_t state_hash;
+    uint64_t framebuffer_hash;
+};
+
+struct job{
+    char *rom;
+    char *input;
+    long budget;
+    unsigned int seed;
+};
+
+struct input_event{
+    long frame;
+    unsigned short keys;
+};
+
+/* Bump allocator, everything a job allocates is dropped at once when it ends */
+struct arena{
+    unsigned char *base;
+    size_t size;
+    size_t used;
+};
+
+/* Job indices, the owner takes from the tail and thieves from the head */
+struct deque{
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+};
+
+struct pool;
+
+struct worker{
+    pthread_t thread;
+    size_t id;
+    struct pool *pool;
+    struct deque deque;
+    struct arena arena;
+    /* Lives at the start of the arena for the whole run */
+    struct chip8 *chip;
+    size_t mark;
+};
+
+struct pool{
+    const struct job *jobs;
+    core_fn core;
+    struct worker *workers;
+    size_t worker_count;
+    pthread_mutex_t output_lock;
+    FILE *output;
+};
+
+static void *arena_alloc(struct arena *arena, size_t size){
+    size_t start = (arena->used + 63) & ~(size_t)63;
+    if(start + size > arena->size){
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+static int take_own(struct deque *deque, size_t *job){
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head != deque->tail){
+        *job = deque->jobs[--deque->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int steal(struct deque *deque, size_t *job){
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head != deque->tail){
+        *job = deque->jobs[deque->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/* Reads a whole file into the arena, returns NULL on failure */
+static unsigned char *read_file(struct arena *arena, const char *path, size_t *size){
+    FILE *fd = fopen(path, "rb");
+    if(fd == NULL){
+        return NULL;
+    }
+    fseek(fd, 0, SEEK_END);
+    long length = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+
+    unsigned char *data = length >= 0 ? arena_alloc(arena, length + 1) : NULL;
+    if(data != NULL && fread(data, 1, length, fd) == (size_t)length){
+        data[length] = '\0';
+        *size = length;
+    }else{
+        data = NULL;
+    }
+    fclose(fd);
+    return data;
+}
+
+/* Parses an input script into the arena. Returns the number of events, or -1. */
+static long parse_input(struct arena *arena, const char *path, struct input_event **events){
+    *events = NULL;
+    if(strcmp(path, "-") == 0){
+        return 0;
+    }
+    size_t size;
+    char *text = (char *)read_file(arena, path, &size);
+    if(text == NULL){
+        return -1;
+    }
+
+    /* At most one event per line */
+    size_t lines = 1;
+    for(size_t i = 0; i < size; i++){
+        lines += text[i] == '\n';
+    }
+    struct input_event *list = arena_alloc(arena, lines * sizeof(struct input_event));
+    if(list == NULL){
+        return -1;
+    }
+
+    long count = 0;
+    for(char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")){
+        long frame;
+        unsigned int keys;
+        if(line[0] == '#' || sscanf(line, "%ld %x", &frame, &keys) != 2){
+            continue;
+        }
+        list[count].frame = frame;
+        list[count].keys = keys;
+        count++;
+    }
+    *events = list;
+    return count;
+}
+
+/* Presses and releases keys so that exactly the keys in held are down */
+static void set_keys(struct chip8 *chip, unsigned short previous, unsigned short held){
+    unsigned short changed = previous ^ held;
+    for(int key = 0; key < 16; key++){
+        if((changed >> key) & 1){
+            key_event(chip, key, (held >> key) & 1);
+        }
+    }
+}
+
+static void run_job(struct worker *worker, size_t index, struct result *result){
+    const struct job *job = &worker->pool->jobs[index];
+    struct chip8 *chip = worker->chip;
+    struct input_event *events;
+    size_t rom_size;
+
+    worker->arena.used = worker->mark;
+    result->job = index;
+    result->cycles = 0;
+
+    init_chip8(chip);
+    seed_chip8(chip, job->seed);
+    unsigned char *rom = read_file(&worker->arena, job->rom, &rom_size);
+    long event_count = parse_input(&worker->arena, job->input, &events);
+    if(rom == NULL || event_count < 0 || load_rom_buffer(chip, rom, rom_size) < 0){
+        result->status = RESULT_ERROR;
+        result->state_hash = 0;
+        result->framebuffer_hash = 0;
+        release_chip8(chip);
+        return;
+    }
+
+    long next_event = 0;
+    unsigned short held = 0;
+    result->status = RESULT_DONE;
+    for(long frame = 0; result->cycles < (uint64_t)job->budget; frame++){
+        while(next_event < event_count && events[next_event].frame <= frame){
+            set_keys(chip, held, events[next_event].keys);
+            held = events[next_event].keys;
+            next_event++;
+        }
+        poll_keys(chip);
+        if(chip->waiting_for_key){
+            if(next_event == event_count){
+                result->status = RESULT_STALLED;
+                break;
+            }
+        }else{
+            long remaining = job->budget - result->cycles;
+            long executed = worker->pool->core(chip, remaining < chip->instructions_per_frame ? remaining : chip->instructions_per_frame);
+            if(executed < 0){
+                result->status = RESULT_FAULT;
+                break;
+            }
+            result->cycles += executed;
+            /* A 1nnn to itself is recognized when it is decoded, nothing can change after it */
+            if(chip->pc < 0x1000 - 1 && !(chip->pc & 1)){
+                const struct decoded_instruction *d = &chip->decode_cache[chip->pc >> 1];
+                if(d->handler != NULL && d->op == OP_JMP_SELF){
+                    result->status = RESULT_HALTED;
+                    break;
+                }
+            }
+        }
+        tick_timers(chip);
+    }
+    result->state_hash = hash_state(chip);
+    result->framebuffer_hash = hash_framebuffer(chip);
+    release_chip8(chip);
+}
+
+static void *work(void *argument){
+    struct worker *worker = argument;
+    struct pool *pool = worker->pool;
+    struct result result;
+    size_t job;
+
+    for(;;){
+        int found = take_own(&worker->deque, &job);
+        for(size_t i = 1; !found && i < pool->worker_count; i++){
+            found = steal(&pool->workers[(worker->id + i) % pool->worker_count].deque, &job);
+        }
+        if(!found){
+            /* Jobs are never added once the run starts, so empty everywhere means done */
+            return NULL;
+        }
+        run_job(worker, job, &result);
+
+        pthread_mutex_lock(&pool->output_lock);
+        fwrite(&result, sizeof(result), 1, pool->output);
+        pthread_mutex_unlock(&pool->output_lock);
+    }
+}
+
+static void free_jobs(struct job *jobs, long count){
+    for(long i = 0; i < count; i++){
+        free(jobs[i].rom);
+        free(jobs[i].input);
+    }
+    free(jobs);
+}
+
+/* Reads the manifest. Returns the number of jobs, or -1. */
+static long read_manifest(const char *path, struct job **jobs){
+    FILE *fd = fopen(path, "r");
+    if(fd == NULL){
+        perror("Error opening the manifest");
+        return -1;
+    }
+    long count = 0, capacity = 64;
+    *jobs = malloc(capacity * sizeof(struct job));
+    if(*jobs == NULL){
+        perror("Error allocating the jobs");
+        fclose(fd);
+        return -1;
+    }
+    char line[4096], rom[2048], input[2048];
+
+    while(fgets(line, sizeof(line), fd) != NULL){
+        struct job job = {0};
+        if(line[0] == '#' || sscanf(line, "%2047s %2047s %ld %u", rom, input, &job.budget, &job.seed) < 3){
+            continue;
+        }
+        if(count == capacity){
+            struct job *grown = realloc(*jobs, capacity * 2 * sizeof(struct job));
+            if(grown == NULL){
+                perror("Error allocating the jobs");
+                free_jobs(*jobs, count);
+                fclose(fd);
+                return -1;
+            }
+            *jobs = grown;
+            capacity *= 2;
+        }
+        job.rom = strdup(rom);
+        job.input = strdup(input);
+        if(job.rom == NULL || job.input == NULL){
+            perror("Error allocating the jobs");
+            free(job.rom);
+            free(job.input);
+            free_jobs(*jobs, count);
+            fclose(fd);
+            return -1;
+        }
+        (*jobs)[count++] = job;
+    }
+    fclose(fd);
+    return count;
+}
+
+int main(int argc, char **argv){
+    const char *output = "results.bin";
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    core_fn core = decode;
+    int opt;
+
+    while((opt = getopt(argc, argv, "j:to:")) != -1){
+        switch(opt){
+            case 'j': {
+                threads = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 't': {
+                core = decode_threaded;
+                break;
+            }
+            case 'o': {
+                output = optarg;
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: %s [-j threads] [-t] [-o results] manifest\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    if(optind >= argc){
+        fprintf(stderr, "Usage: %s [-j threads] [-t] [-o results] manifest\n", argv[0]);
+        return 1;
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+
+    struct job *jobs;
+    long job_count = read_manifest(argv[optind], &jobs);
+    if(job_count < 0){
+        return 1;
+    }
+
+    struct pool pool = {jobs, core, NULL, threads};
+    pool.output = fopen(output, "wb");
+    if(pool.output == NULL){
+        perror("Error opening the results file");
+        return 1;
+    }
+    pthread_mutex_init(&pool.output_lock, NULL);
+    pool.workers = calloc(threads, sizeof(struct worker));
+    if(pool.workers == NULL){
+        perror("Error allocating the workers");
+        return 1;
+    }
+
+    /* Contiguous slices, stealing evens out whatever the slices cost */
+    for(long i = 0; i < threads; i++){
+        struct worker *worker = &pool.workers[i];
+        worker->id = i;
+        worker->pool = &pool;
+        worker->arena.base = aligned_alloc(64, ARENA_SIZE);
+        worker->deque.jobs = malloc((job_count / threads + 1) * sizeof(size_t));
+        if(worker->arena.base == NULL || worker->deque.jobs == NULL){
+            perror("Error allocating the workers");
+            return 1;
+        }
+        worker->arena.size = ARENA_SIZE;
+        worker->chip = arena_alloc(&worker->arena, sizeof(struct chip8));
+        worker->mark = worker->arena.used;
+
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.head = 0;
+        worker->deque.tail = 0;
+        for(long job = job_count * i / threads; job < job_count * (i + 1) / threads; job++){
+            worker->deque.jobs[worker->deque.tail++] = job;
+        }
+    }
+    /* The workers that did start steal the jobs of those that did not */
+    long started = 0;
+    while(started < threads){
+        int error = pthread_create(&pool.workers[started].thread, NULL, work, &pool.workers[started]);
+        if(error != 0){
+            errno = error;
+            perror("Error starting a worker");
+            break;
+        }
+        started++;
+    }
+    for(long i = 0; i < started; i++){
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    fclose(pool.output);
+
+    for(long i = 0; i < threads; i++){
+        free(pool.workers[i].arena.base);
+        free(pool.workers[i].deque.jobs);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+    free(pool.workers);
+    free_jobs(jobs, job_count);
+    pthread_mutex_destroy(&pool.output_lock);
+    return started > 0 ? 0 : 1;
+}
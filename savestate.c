@@ -0,0 +1,81 @@
+#include <string.h>
+#include "hash.h"
+#include "savestate.h"
+
+_Static_assert(offsetof(struct chip8, registers) == 0, "the machine state must start struct chip8");
+
+/* Saves the machine state, with a checksum if checksum is non zero */
+void chip8_save_state(const struct chip8 *chip, struct chip8_state *state, int checksum){
+    state->magic = CHIP8_STATE_MAGIC;
+    state->version = CHIP8_STATE_VERSION;
+    state->flags = checksum ? CHIP8_STATE_CHECKSUM : 0;
+    state->size = CHIP8_STATE_SIZE;
+    state->reserved = 0;
+    memcpy(state->state, chip, CHIP8_STATE_SIZE);
+    state->checksum = checksum ? fnv1a(FNV_OFFSET_BASIS, state->state, CHIP8_STATE_SIZE) : 0;
+}
+
+/* Memory is compared in blocks of this many bytes before looking at single bytes */
+#define COMPARE_BLOCK 64
+
+/*
+    Drops the decoded instructions for the memory that the restore is about
+    to change, and nothing else. Most restores in a search only differ in a
+    handful of bytes, so whole blocks are skipped first.
+*/
+static void invalidate_changed(struct chip8 *chip, const unsigned char *memory){
+    for(size_t i = 0; i < sizeof(chip->memory); i += COMPARE_BLOCK){
+        if(memcmp(chip->memory + i, memory + i, COMPARE_BLOCK) == 0){
+            continue;
+        }
+        for(size_t j = i; j < i + COMPARE_BLOCK; j++){
+            if(chip->memory[j] != memory[j]){
+                invalidate_decoded(chip, j);
+            }
+        }
+    }
+}
+
+/* Reads a field of the machine out of saved state bytes */
+#define STATE_FIELD(state, field, value) \
+    memcpy(&(value), (state) + offsetof(struct chip8, field), sizeof(value))
+
+/*
+    Whether saved state bytes hold values the cores can run from: a stack
+    pointer within the stack, a key register and wait flag Fx0A could have
+    left, and a generator state xorshift can leave
+*/
+static int valid_state_bytes(const unsigned char *state){
+    unsigned char sp, waiting_for_key, key_register;
+    unsigned int rng_state;
+    STATE_FIELD(state, sp, sp);
+    STATE_FIELD(state, waiting_for_key, waiting_for_key);
+    STATE_FIELD(state, key_register, key_register);
+    STATE_FIELD(state, rng_state, rng_state);
+    return sp <= 16 && waiting_for_key <= 1 && key_register <= 0xf && rng_state != 0;
+}
+
+/* Restores a saved machine. Returns -1, leaving the machine alone, if the state is not valid for this build. */
+int chip8_load_state(struct chip8 *chip, const struct chip8_state *state){
+    if(state->magic != CHIP8_STATE_MAGIC || state->version != CHIP8_STATE_VERSION ||
+            state->size != CHIP8_STATE_SIZE){
+        return -1;
+    }
+    if((state->flags & CHIP8_STATE_CHECKSUM) &&
+            state->checksum != fnv1a(FNV_OFFSET_BASIS, state->state, CHIP8_STATE_SIZE)){
+        return -1;
+    }
+    if(!valid_state_bytes(state->state)){
+        return -1;
+    }
+    chip8_load_state_bytes(chip, state->state);
+    return 0;
+}
+
+/* Restores CHIP8_STATE_SIZE bytes of machine state, as found in chip8_state.state */
+void chip8_load_state_bytes(struct chip8 *chip, const unsigned char *state){
+    invalidate_changed(chip, state + offsetof(struct chip8, memory));
+    memcpy(chip, state, CHIP8_STATE_SIZE);
+    /* The screen may have been anything before */
+    chip->dirty_rows = 0xffffffff;
+}
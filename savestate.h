@@ -0,0 +1,35 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Bumped whenever the machine state part of struct chip8 changes layout */
+#define CHIP8_STATE_VERSION 1
+#define CHIP8_STATE_MAGIC 0x54533843u
+#define CHIP8_STATE_CHECKSUM 1
+
+/* The bytes of struct chip8 that make up the machine state */
+#define CHIP8_STATE_SIZE (offsetof(struct chip8, rng_state) + sizeof(unsigned int))
+
+/*
+    A saved machine. Fixed size and self contained, so it can be kept in
+    arrays, written to files as is and restored without allocating.
+*/
+struct chip8_state{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t size;
+    uint32_t reserved;
+    /* FNV-1a of state, when flags has CHIP8_STATE_CHECKSUM */
+    uint64_t checksum;
+    unsigned char state[CHIP8_STATE_SIZE];
+};
+
+void chip8_save_state(const struct chip8 *, struct chip8_state *, int);
+int chip8_load_state(struct chip8 *, const struct chip8_state *);
+void chip8_load_state_bytes(struct chip8 *, const unsigned char *);
+
+#endif
@@ -0,0 +1,52 @@
+#include <errno.h>
+#include "cpu.h"
+#include "scheduler.h"
+
+#define NS_PER_SECOND 1000000000L
+/* Beyond this many frames behind, the schedule starts over instead of catching up */
+#define MAX_LAG_FRAMES 6
+
+static long long to_ns(const struct timespec *time){
+    return (long long)time->tv_sec * NS_PER_SECOND + time->tv_nsec;
+}
+
+void start_scheduler(struct scheduler *scheduler){
+    clock_gettime(CLOCK_MONOTONIC, &scheduler->start);
+    scheduler->frame = 0;
+    scheduler->dropped_frames = 0;
+}
+
+/*
+    Sleeps until the next frame is due. A frame that is already late
+    returns at once, so a short stall is caught up on and the average
+    stays at 60Hz. After a long one (a debugger, a suspended laptop) the
+    missed frames are dropped rather than run back to back. While chip,
+    which may be NULL, waits on Fx0A a key press ends the sleep early and
+    the next deadline stays where it was.
+*/
+void wait_for_frame(struct scheduler *scheduler, struct chip8 *chip){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    scheduler->frame++;
+    long long deadline = to_ns(&scheduler->start) + scheduler->frame * NS_PER_SECOND / 60;
+    long long lag = to_ns(&now) - deadline;
+    if(lag > MAX_LAG_FRAMES * NS_PER_SECOND / 60){
+        scheduler->dropped_frames += lag * 60 / NS_PER_SECOND;
+        scheduler->start = now;
+        scheduler->frame = 0;
+        return;
+    }
+    if(lag >= 0){
+        return;
+    }
+
+    struct timespec wake = {deadline / NS_PER_SECOND, deadline % NS_PER_SECOND};
+    if(chip != NULL && chip->waiting_for_key){
+        wait_for_input_until(chip, &wake);
+        return;
+    }
+    /* An absolute deadline, so a signal only means going back to sleep */
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR){
+    }
+}
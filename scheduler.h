@@ -0,0 +1,24 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <time.h>
+
+struct chip8;
+
+/*
+    Paces frames to 60Hz on the monotonic clock. Deadlines are computed
+    from the start, frame n is due at start + n / 60 s, so rounding and
+    oversleeping never add up to drift.
+*/
+struct scheduler{
+    struct timespec start;
+    /* Frames since start, the next deadline is that of frame + 1 */
+    long frame;
+    /* Frames given up on because the host fell too far behind */
+    long dropped_frames;
+};
+
+void start_scheduler(struct scheduler *);
+void wait_for_frame(struct scheduler *, struct chip8 *);
+
+#endif
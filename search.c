@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "savestate.h"
+#include "condition.h"
+
+/*
+    chip8-search: explores the inputs a ROM can be given, level by level,
+    and finds the shortest one that makes a memory byte meet a condition.
+
+    Usage: chip8-search [-j threads] [-t] [-s seed] [-l state] [-a frames]
+                        [-d depth] [-n states] [-w width] [-k keys]
+                        [-c condition] [-o input] rom
+    -j number of worker threads, one per online CPU by default
+    -t selects the threaded interpreter core
+    -s seeds the random number generator, 0 by default as in chip8-batch,
+       so that the input found replays there with the same seed
+    -l starts from a savestate file, a struct chip8_state, instead of reset
+    -a frames each input is held for, 4 by default
+    -d stops after this many inputs, 1000 by default
+    -n stops after this many distinct states, 65536 by default
+    -w keeps only the width states closest to the condition at every
+       level, a best-first search instead of a breadth-first one
+    -k the keys to try, as a list of hex digits, all 16 by default.
+       Holding no key is always tried.
+    -c the condition, "address op value" with op one of == != < <= > >=,
+       for example -c "0x1f0 >= 3"
+    -o where the input that reaches the condition goes, as a chip8-batch
+       input script, stdout by default
+
+    States are told apart by a hash of the whole machine state, so every
+    state is expanded once however many inputs lead to it.
+*/
+
+#define NO_NODE UINT32_MAX
+/* Frontier states a worker takes at a time */
+#define CHUNK 16
+
+/* How a state was first reached */
+struct node{
+    uint32_t parent;
+    uint16_t keys;
+    uint16_t depth;
+};
+
+/*
+    Open addressing set of state hashes, shared by all workers without a
+    lock. 0 marks an empty slot, so a hash of 0 is stored as 1.
+*/
+struct state_set{
+    _Atomic uint64_t *slots;
+    size_t mask;
+};
+
+/* States of one level, CHIP8_STATE_SIZE bytes each, and their nodes */
+struct frontier{
+    unsigned char *states;
+    uint32_t *nodes;
+    atomic_size_t count;
+};
+
+struct search{
+    core_fn core;
+    struct condition condition;
+    unsigned short *actions;
+    int action_count;
+    int frames;
+
+    struct state_set set;
+    struct node *nodes;
+    atomic_size_t node_count;
+    size_t max_nodes;
+    atomic_int limit_reached;
+    _Atomic uint32_t found;
+
+    struct frontier *current;
+    struct frontier *next;
+    /* Next index of current to hand out */
+    atomic_size_t taken;
+};
+
+struct worker{
+    pthread_t thread;
+    struct search *search;
+    struct chip8 *chip;
+};
+
+/* The MurmurHash3 finalizer, every input bit reaches every output bit */
+static uint64_t mix(uint64_t hash){
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*
+    Hashes the machine state a word at a time in four independent lanes.
+    FNV-1a goes a byte at a time and would cost more than running the
+    frames that lead to the state.
+*/
+static uint64_t hash_machine(const unsigned char *state){
+    uint64_t lanes[4] = {0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0x2545f4914f6cdd1dull};
+    size_t i = 0;
+
+    for(; i + 4 * sizeof(uint64_t) <= CHIP8_STATE_SIZE; i += 4 * sizeof(uint64_t)){
+        for(int l = 0; l < 4; l++){
+            uint64_t word;
+            memcpy(&word, state + i + l * sizeof(uint64_t), sizeof(word));
+            lanes[l] = (lanes[l] ^ word) * 0x100000001b3ull;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    uint64_t hash = mix(lanes[0]) ^ mix(lanes[1] + 1) ^ mix(lanes[2] + 2) ^ mix(lanes[3] + 3);
+    for(; i < CHIP8_STATE_SIZE; i++){
+        hash = (hash ^ state[i]) * 0x100000001b3ull;
+    }
+    return mix(hash);
+}
+
+/* Returns 1 if hash was not in the set yet, 0 if it was or the set is full */
+static int set_insert(struct state_set *set, uint64_t hash){
+    if(hash == 0){
+        hash = 1;
+    }
+    for(size_t i = 0, slot = hash & set->mask; i <= set->mask; i++, slot = (slot + 1) & set->mask){
+        uint64_t seen = atomic_load_explicit(&set->slots[slot], memory_order_relaxed);
+        if(seen == 0 && atomic_compare_exchange_strong(&set->slots[slot], &seen, hash)){
+            return 1;
+        }
+        /* A failed exchange left what the other thread stored in seen */
+        if(seen == hash){
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* How far a state is from meeting the condition, what best-first ranks by */
+static int distance(const struct condition *condition, const unsigned char *state){
+    int byte = state[offsetof(struct chip8, memory) + condition->address];
+    int value = condition->value;
+    switch(condition->comparison){
+        case COMPARE_EQ: return abs(byte - value);
+        case COMPARE_LT:
+        case COMPARE_LE: return byte > value ? byte - value : 0;
+        case COMPARE_GT:
+        case COMPARE_GE: return byte < value ? value - byte : 0;
+        default: return 0;
+    }
+}
+
+static unsigned short held_keys(const struct chip8 *chip){
+    unsigned short held = 0;
+    for(int i = 0; i < 16; i++){
+        held |= (chip->keys[i] & 1) << i;
+    }
+    return held;
+}
+
+/* Adds the state the worker's machine is in, reached from parent by holding keys */
+static void discover(struct search *search, struct chip8 *chip, uint32_t parent, unsigned short keys, int depth){
+    /* Dirty rows only matter to a display, they would keep equal states apart */
+    chip->dirty_rows = 0;
+    if(atomic_load_explicit(&search->limit_reached, memory_order_relaxed) ||
+            !set_insert(&search->set, hash_machine((const unsigned char *)chip))){
+        return;
+    }
+    size_t id = atomic_fetch_add(&search->node_count, 1);
+    if(id >= search->max_nodes){
+        atomic_store(&search->limit_reached, 1);
+        return;
+    }
+    search->nodes[id] = (struct node){parent, keys, depth};
+    if(condition_met(&search->condition, chip)){
+        uint32_t none = NO_NODE;
+        atomic_compare_exchange_strong(&search->found, &none, id);
+    }
+
+    struct frontier *next = search->next;
+    size_t slot = atomic_fetch_add(&next->count, 1);
+    memcpy(next->states + slot * CHIP8_STATE_SIZE, chip, CHIP8_STATE_SIZE);
+    next->nodes[slot] = id;
+}
+
+/* Tries every input on the states of the current level */
+static void *expand(void *argument){
+    struct worker *worker = argument;
+    struct search *search = worker->search;
+    struct frontier *current = search->current;
+    struct chip8 *chip = worker->chip;
+    size_t count = atomic_load(&current->count);
+
+    for(;;){
+        size_t start = atomic_fetch_add(&search->taken, CHUNK);
+        if(start >= count){
+            return NULL;
+        }
+        size_t end = start + CHUNK < count ? start + CHUNK : count;
+        for(size_t i = start; i < end; i++){
+            const unsigned char *state = current->states + i * CHIP8_STATE_SIZE;
+            uint32_t parent = current->nodes[i];
+            int depth = search->nodes[parent].depth + 1;
+
+            for(int a = 0; a < search->action_count; a++){
+                unsigned short keys = search->actions[a];
+                chip8_load_state_bytes(chip, state);
+                /* Keys already held at the end of the last input are not pressed again */
+                set_keypad(chip, keys, keys & ~held_keys(chip));
+                int frame = 0;
+                while(frame < search->frames && run_frame(chip, search->core) == 0){
+                    frame++;
+                }
+                if(frame == search->frames){
+                    discover(search, chip, parent, keys, depth);
+                }
+            }
+        }
+    }
+}
+
+static struct frontier *new_frontier(size_t states){
+    struct frontier *frontier = malloc(sizeof(struct frontier));
+    if(frontier == NULL){
+        return NULL;
+    }
+    frontier->states = malloc(states * CHIP8_STATE_SIZE);
+    frontier->nodes = malloc(states * sizeof(uint32_t));
+    atomic_init(&frontier->count, 0);
+    if(frontier->states == NULL || frontier->nodes == NULL){
+        free(frontier->states);
+        free(frontier->nodes);
+        free(frontier);
+        return NULL;
+    }
+    return frontier;
+}
+
+static void free_frontier(struct frontier *frontier){
+    if(frontier != NULL){
+        free(frontier->states);
+        free(frontier->nodes);
+        free(frontier);
+    }
+}
+
+/* Frees whatever main() got to allocate for the search */
+static void free_search(struct search *search){
+    free_frontier(search->current);
+    free_frontier(search->next);
+    free(search->set.slots);
+    free(search->nodes);
+    free(search->actions);
+}
+
+static void free_workers(struct worker *workers, long threads){
+    for(long i = 0; i < threads; i++){
+        if(workers[i].chip != NULL){
+            free_chip8(workers[i].chip);
+        }
+    }
+    free(workers);
+}
+
+/* For sorting the next level by distance, ties broken by discovery order */
+struct ranked{
+    int distance;
+    uint32_t node;
+    size_t index;
+};
+
+static int compare_ranked(const void *a, const void *b){
+    const struct ranked *x = a, *y = b;
+    if(x->distance != y->distance){
+        return x->distance < y->distance ? -1 : 1;
+    }
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+/* Keeps the width states of the next level closest to the condition, moved into into */
+static void keep_best(struct search *search, struct frontier *into, size_t width){
+    struct frontier *next = search->next;
+    size_t count = atomic_load(&next->count);
+    struct ranked *ranked = malloc(count * sizeof(struct ranked));
+
+    for(size_t i = 0; i < count; i++){
+        ranked[i].distance = distance(&search->condition, next->states + i * CHIP8_STATE_SIZE);
+        ranked[i].node = next->nodes[i];
+        ranked[i].index = i;
+    }
+    qsort(ranked, count, sizeof(struct ranked), compare_ranked);
+    if(count > width){
+        count = width;
+    }
+    for(size_t i = 0; i < count; i++){
+        memcpy(into->states + i * CHIP8_STATE_SIZE, next->states + ranked[i].index * CHIP8_STATE_SIZE, CHIP8_STATE_SIZE);
+        into->nodes[i] = ranked[i].node;
+    }
+    atomic_store(&into->count, count);
+    free(ranked);
+}
+
+/* Writes the inputs leading to node as a chip8-batch input script */
+static void write_input(const struct search *search, uint32_t node, FILE *out){
+    int depth = search->nodes[node].depth;
+    unsigned short *keys = malloc((depth + 1) * sizeof(unsigned short));
+
+    for(int d = depth; d > 0; d--){
+        keys[d - 1] = search->nodes[node].keys;
+        node = search->nodes[node].parent;
+    }
+    fprintf(out, "# %d inputs of %d frames\n", depth, search->frames);
+    for(int d = 0; d < depth; d++){
+        fprintf(out, "%d %x\n", d * search->frames, keys[d]);
+    }
+    free(keys);
+}
+
+static double seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-j threads] [-t] [-s seed] [-l state] [-a frames] [-d depth] [-n states] "
+            "[-w width] [-k keys] [-c condition] [-o input] rom\n", name);
+}
+
+int main(int argc, char **argv){
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    core_fn core = decode;
+    unsigned int seed = 0;
+    const char *state_path = NULL;
+    const char *output = NULL;
+    const char *keys = "0123456789abcdef";
+    int frames = 4;
+    int max_depth = 1000;
+    size_t max_nodes = 65536;
+    size_t width = 0;
+    struct condition condition = {0};
+    int opt;
+
+    while((opt = getopt(argc, argv, "j:ts:l:a:d:n:w:k:c:o:")) != -1){
+        switch(opt){
+            case 'j': {
+                threads = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 't': {
+                core = decode_threaded;
+                break;
+            }
+            case 's': {
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            }
+            case 'l': {
+                state_path = optarg;
+                break;
+            }
+            case 'a': {
+                frames = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 'd': {
+                max_depth = strtol(optarg, NULL, 0);
+                break;
+            }
+            case 'n': {
+                max_nodes = strtoul(optarg, NULL, 0);
+                break;
+            }
+            case 'w': {
+                width = strtoul(optarg, NULL, 0);
+                break;
+            }
+            case 'k': {
+                keys = optarg;
+                break;
+            }
+            case 'c': {
+                if(parse_condition(optarg, &condition) < 0){
+                    fprintf(stderr, "Bad condition: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'o': {
+                output = optarg;
+                break;
+            }
+            default: {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if(optind >= argc){
+        usage(argv[0]);
+        return 1;
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    if(frames < 1){
+        frames = 1;
+    }
+    if(max_depth > UINT16_MAX){
+        max_depth = UINT16_MAX;
+    }
+    if(max_nodes < 1 || max_nodes >= NO_NODE){
+        max_nodes = NO_NODE - 1;
+    }
+
+    /* The starting machine */
+    struct chip8 *start = new_chip8();
+    if(start == NULL){
+        return 1;
+    }
+    seed_chip8(start, seed);
+    errno = 0;
+    load_rom(start, argv[optind]);
+    if(errno == EINVAL || errno == ENOMEM){
+        free_chip8(start);
+        return 1;
+    }
+    if(state_path != NULL){
+        struct chip8_state *state = malloc(sizeof(struct chip8_state));
+        if(state == NULL){
+            perror("Savestate allocation failed");
+            free_chip8(start);
+            return 1;
+        }
+        FILE *fd = fopen(state_path, "rb");
+        int loaded = fd != NULL && fread(state, sizeof(struct chip8_state), 1, fd) == 1 && chip8_load_state(start, state) == 0;
+        if(fd != NULL){
+            fclose(fd);
+        }
+        free(state);
+        if(!loaded){
+            fprintf(stderr, "%s is not a savestate this build can load\n", state_path);
+            free_chip8(start);
+            return 1;
+        }
+    }
+    start->dirty_rows = 0;
+
+    struct search search = {core, condition};
+    search.frames = frames;
+    /* No key first, then one key at a time */
+    search.actions = malloc(17 * sizeof(unsigned short));
+    if(search.actions == NULL){
+        perror("Search allocation failed");
+        free_chip8(start);
+        return 1;
+    }
+    search.actions[search.action_count++] = 0;
+    for(const char *k = keys; *k != '\0' && search.action_count < 17; k++){
+        char digit[2] = {*k, '\0'};
+        char *end;
+        unsigned long key = strtoul(digit, &end, 16);
+        if(*end == '\0'){
+            search.actions[search.action_count++] = 1 << key;
+        }
+    }
+
+    size_t capacity = 1;
+    while(capacity < 2 * max_nodes + threads){
+        capacity *= 2;
+    }
+    search.set.slots = calloc(capacity, sizeof(uint64_t));
+    search.set.mask = capacity - 1;
+    search.nodes = malloc(max_nodes * sizeof(struct node));
+    search.max_nodes = max_nodes;
+    search.current = new_frontier(max_nodes);
+    search.next = new_frontier(max_nodes);
+    if(search.set.slots == NULL || search.nodes == NULL || search.current == NULL || search.next == NULL){
+        perror("Search allocation failed");
+        free_search(&search);
+        free_chip8(start);
+        return 1;
+    }
+    atomic_init(&search.node_count, 0);
+    atomic_init(&search.limit_reached, 0);
+    atomic_init(&search.found, NO_NODE);
+
+    /* The start is depth 0 and reached with no input */
+    discover(&search, start, NO_NODE, 0, 0);
+    struct frontier *swap = search.current;
+    search.current = search.next;
+    search.next = swap;
+
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if(workers == NULL){
+        perror("Worker allocation failed");
+        free_search(&search);
+        free_chip8(start);
+        return 1;
+    }
+    for(long i = 0; i < threads; i++){
+        workers[i].search = &search;
+        workers[i].chip = new_chip8();
+        if(workers[i].chip == NULL){
+            free_workers(workers, threads);
+            free_search(&search);
+            free_chip8(start);
+            return 1;
+        }
+        chip8_load_state_bytes(workers[i].chip, (const unsigned char *)start);
+    }
+
+    double began = seconds();
+    int depth = 0;
+    printf("depth 0: 1 states\n");
+    while(atomic_load(&search.found) == NO_NODE && depth < max_depth &&
+            atomic_load(&search.current->count) > 0 && !atomic_load(&search.limit_reached)){
+        size_t before = atomic_load(&search.node_count);
+        atomic_store(&search.next->count, 0);
+        atomic_store(&search.taken, 0);
+        /* The workers that did start take the whole level between them */
+        long started = 0;
+        while(started < threads){
+            int error = pthread_create(&workers[started].thread, NULL, expand, &workers[started]);
+            if(error != 0){
+                errno = error;
+                perror("Error starting a worker");
+                break;
+            }
+            started++;
+        }
+        if(started == 0){
+            expand(&workers[0]);
+        }
+        for(long i = 0; i < started; i++){
+            pthread_join(workers[i].thread, NULL);
+        }
+        depth++;
+        size_t after = atomic_load(&search.node_count);
+        printf("depth %d: %zu new states\n", depth, (after < max_nodes ? after : max_nodes) - before);
+
+        if(width > 0){
+            keep_best(&search, search.current, width);
+        }else{
+            swap = search.current;
+            search.current = search.next;
+            search.next = swap;
+        }
+    }
+    double elapsed = seconds() - began;
+
+    size_t states = atomic_load(&search.node_count);
+    if(states > max_nodes){
+        states = max_nodes;
+    }
+    printf("%zu distinct states in %d levels, %.2f s, %.0f states/s\n", states, depth, elapsed, states / elapsed);
+    if(atomic_load(&search.limit_reached)){
+        printf("Stopped at the state limit, raise it with -n\n");
+    }
+
+    int status = 0;
+    uint32_t found = atomic_load(&search.found);
+    if(found != NO_NODE){
+        printf("Condition met after %d inputs, %d frames\n", search.nodes[found].depth, search.nodes[found].depth * frames);
+        FILE *out = output != NULL ? fopen(output, "w") : stdout;
+        if(out == NULL){
+            perror("Error opening the input file");
+            status = 1;
+        }else{
+            write_input(&search, found, out);
+            if(out != stdout){
+                fclose(out);
+            }
+        }
+    }else if(condition.set){
+        printf("Condition not met\n");
+        status = 1;
+    }
+
+    free_workers(workers, threads);
+    free_search(&search);
+    free_chip8(start);
+    return status;
+}
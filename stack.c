@@ -1,16 +1,17 @@
 #define STACK_MAX_SIZE 16
 
-void push(unsigned short *stack, unsigned short sp, unsigned short element){
-    if(sp >= STACK_MAX_SIZE){
+void push(unsigned short *stack, unsigned char *sp, unsigned short element){
+    if(*sp >= STACK_MAX_SIZE){
         return;
     }
-    *(stack + sp) = element;
-    sp++;
+    *(stack + *sp) = element;
+    (*sp)++;
 }
 
-void pop(unsigned short *stack, unsigned short sp){
-    if(sp <= 0){
-        return;
+unsigned short pop(unsigned short *stack, unsigned char *sp){
+    if(*sp <= 0){
+        return 0;
     }
-    sp--;
-}
\ No newline at end of file
+    (*sp)--;
+    return *(stack + *sp);
+}
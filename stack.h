@@ -1,2 +1,2 @@
-void push(unsigned short *, unsigned short, unsigned short);
-void pop(unsigned short *, unsigned short);
\ No newline at end of file
+void push(unsigned short *, unsigned char *, unsigned short);
+unsigned short pop(unsigned short *, unsigned char *);
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include "cpu.h"
+#include "decoder.h"
+
+#ifdef __GNUC__
+
+/*
+    Direct threaded interpreter core. Every handler ends with its own copy of
+    the dispatch sequence, so each instruction kind gets a separate indirect
+    branch that the host's predictor can learn, instead of the single shared
+    one at the top of the switch loop in decode().
+*/
+long decode_threaded(struct chip8 *chip, long budget){
+    static void *const labels[OP_COUNT] = {
+        [OP_INVALID] = &&invalid,
+        [OP_CLS] = &&op_cls,
+        [OP_RET] = &&op_ret,
+        [OP_JMP] = &&op_jmp,
+        [OP_CALL] = &&op_call,
+        [OP_ISKIP_ON_EQUAL] = &&op_iskip_on_equal,
+        [OP_ISKIP_ON_NOT_EQUAL] = &&op_iskip_on_not_equal,
+        [OP_SKIP_ON_EQUAL] = &&op_skip_on_equal,
+        [OP_ILOAD] = &&op_iload,
+        [OP_IADD] = &&op_iadd,
+        [OP_ASSIGN] = &&op_assign,
+        [OP_OR] = &&op_or,
+        [OP_AND] = &&op_and,
+        [OP_XOR] = &&op_xor,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_SHR] = &&op_shr,
+        [OP_SUBN] = &&op_subn,
+        [OP_SHL] = &&op_shl,
+        [OP_SKIP_ON_NOT_EQUAL] = &&op_skip_on_not_equal,
+        [OP_SET_INDEX] = &&op_set_index,
+        [OP_JMP_REL] = &&op_jmp_rel,
+        [OP_SET_RAND] = &&op_set_rand,
+        [OP_DISPLAY_SPRITE] = &&op_display_sprite,
+        [OP_SKIP_PRESSED] = &&op_skip_pressed,
+        [OP_SKIP_NOT_PRESSED] = &&op_skip_not_pressed,
+        [OP_LOAD_DELAY] = &&op_load_delay,
+        [OP_WAIT_FOR_KEY] = &&yield,
+        [OP_SET_DELAY] = &&op_set_delay,
+        [OP_SET_SOUND] = &&op_set_sound,
+        [OP_ADD_TO_INDEX] = &&op_add_to_index,
+        [OP_LOAD_LOCATION] = &&op_load_location,
+        [OP_STORE_BCD] = &&op_store_bcd,
+        [OP_STORE_REGISTERS] = &&op_store_registers,
+        [OP_LOAD_REGISTERS] = &&op_load_registers,
+        [OP_ILOAD_DISPLAY_SPRITE] = &&op_iload_display_sprite,
+        [OP_SET_INDEX_ADD_TO_INDEX] = &&op_set_index_add_to_index,
+        [OP_IADD_ISKIP_ON_EQUAL] = &&op_iadd_iskip_on_equal,
+        [OP_LOAD_DELAY_ISKIP_ON_EQUAL] = &&op_load_delay_iskip_on_equal,
+        [OP_WAIT_DELAY] = &&yield,
+        [OP_JMP_SELF] = &&yield,
+    };
+    struct decoded_instruction *d;
+    long remaining = budget;
+    int status;
+
+#define DISPATCH() \
+    do{ \
+        if(--remaining < 0){ \
+            return budget; \
+        } \
+        if(chip->pc >= 0x1000 - 1){ \
+            goto invalid_address; \
+        } \
+        if(chip->pc & 1){ \
+            goto uncached; \
+        } \
+        d = &chip->decode_cache[chip->pc >> 1]; \
+        if(d->handler == NULL){ \
+            predecode_at(chip, d, chip->pc); \
+        } \
+        goto *labels[d->op]; \
+    }while(0)
+
+    DISPATCH();
+
+op_cls:
+    cls(chip);
+    DISPATCH();
+op_ret:
+    ret(chip);
+    DISPATCH();
+op_jmp:
+    jmp(chip, d->nnn);
+    DISPATCH();
+op_call:
+    call(chip, d->nnn);
+    DISPATCH();
+op_iskip_on_equal:
+    iskip_on_equal(chip, d->x, d->kk);
+    DISPATCH();
+op_iskip_on_not_equal:
+    iskip_on_not_equal(chip, d->x, d->kk);
+    DISPATCH();
+op_skip_on_equal:
+    skip_on_equal(chip, d->x, d->y);
+    DISPATCH();
+op_iload:
+    iload(chip, d->x, d->kk);
+    DISPATCH();
+op_iadd:
+    iadd(chip, d->x, d->kk);
+    DISPATCH();
+op_assign:
+    assign(chip, d->x, d->y);
+    DISPATCH();
+op_or:
+    _or(chip, d->x, d->y);
+    DISPATCH();
+op_and:
+    _and(chip, d->x, d->y);
+    DISPATCH();
+op_xor:
+    _xor(chip, d->x, d->y);
+    DISPATCH();
+op_add:
+    add(chip, d->x, d->y);
+    DISPATCH();
+op_sub:
+    sub(chip, d->x, d->y);
+    DISPATCH();
+op_shr:
+    shr(chip, d->x);
+    DISPATCH();
+op_subn:
+    subn(chip, d->x, d->y);
+    DISPATCH();
+op_shl:
+    shl(chip, d->x);
+    DISPATCH();
+op_skip_on_not_equal:
+    skip_on_not_equal(chip, d->x, d->y);
+    DISPATCH();
+op_set_index:
+    set_index(chip, d->nnn);
+    DISPATCH();
+op_jmp_rel:
+    jmp_rel(chip, d->nnn);
+    DISPATCH();
+op_set_rand:
+    set_rand(chip, d->x, d->kk);
+    DISPATCH();
+op_display_sprite:
+    display_sprite(chip, d->x, d->y, d->n);
+    DISPATCH();
+op_skip_pressed:
+    skip_pressed(chip, d->x);
+    DISPATCH();
+op_skip_not_pressed:
+    skip_not_pressed(chip, d->x);
+    DISPATCH();
+op_load_delay:
+    load_delay(chip, d->x);
+    DISPATCH();
+op_set_delay:
+    set_delay(chip, d->x);
+    DISPATCH();
+op_set_sound:
+    set_sound(chip, d->x);
+    DISPATCH();
+op_add_to_index:
+    add_to_index(chip, d->x);
+    DISPATCH();
+op_load_location:
+    load_location(chip, d->x);
+    DISPATCH();
+op_store_bcd:
+    store_bcd(chip, d->x);
+    DISPATCH();
+op_store_registers:
+    store_registers(chip, d->x);
+    DISPATCH();
+op_load_registers:
+    load_registers(chip, d->x);
+    DISPATCH();
+op_iload_display_sprite:
+    if(remaining == 0){
+        goto uncached;
+    }
+    remaining--;
+    iload_display_sprite(chip, d->x, d->kk, d->x2, d->y2, d->n2);
+    COUNT_FUSION(chip, OP_ILOAD_DISPLAY_SPRITE);
+    DISPATCH();
+op_set_index_add_to_index:
+    if(remaining == 0){
+        goto uncached;
+    }
+    remaining--;
+    set_index_add_to_index(chip, d->nnn, d->x2);
+    COUNT_FUSION(chip, OP_SET_INDEX_ADD_TO_INDEX);
+    DISPATCH();
+op_iadd_iskip_on_equal:
+    if(remaining == 0){
+        goto uncached;
+    }
+    remaining--;
+    iadd_iskip_on_equal(chip, d->x, d->kk, d->x2, d->kk2);
+    COUNT_FUSION(chip, OP_IADD_ISKIP_ON_EQUAL);
+    DISPATCH();
+op_load_delay_iskip_on_equal:
+    if(remaining == 0){
+        goto uncached;
+    }
+    remaining--;
+    load_delay_iskip_on_equal(chip, d->x, d->x2, d->kk2);
+    COUNT_FUSION(chip, OP_LOAD_DELAY_ISKIP_ON_EQUAL);
+    DISPATCH();
+
+yield:
+    /* Idle loops and Fx0A, their handlers decide whether the frame ends */
+    if(d->handler(chip, d) > 0){
+        return budget - remaining;
+    }
+    DISPATCH();
+
+uncached:
+    /*
+        Odd addresses are not cached, and a superinstruction with a single
+        instruction of budget left runs only its first half. Both go
+        through the reference decoder.
+    */
+    status = execute(chip, fetch(chip));
+    if(status < 0){
+        goto invalid;
+    }
+    if(status > 0){
+        return budget - remaining;
+    }
+    DISPATCH();
+
+invalid:
+    perror("Invalid instruction\n");
+    return -1;
+
+invalid_address:
+    perror("Invalid memory address\n");
+    return -1;
+
+#undef DISPATCH
+}
+
+#else
+
+/* Labels as values are a GNU extension, fall back to the switch core */
+long decode_threaded(struct chip8 *chip, long budget){
+    return decode(chip, budget);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include <string.h>
+#include "triple_buffer.h"
+
+/* Set in shared while the slot holds a frame the consumer has not seen */
+#define FRAME_FRESH 4u
+#define FRAME_INDEX 3u
+
+void init_triple_buffer(struct triple_buffer *buffer){
+    memset(buffer->frames, 0, sizeof(buffer->frames));
+    buffer->back = 0;
+    buffer->front = 1;
+    buffer->carry = 0;
+    atomic_init(&buffer->shared, 2);
+}
+
+/*
+    Publishes the framebuffer with the rows changed since the previous
+    publish. A frame that is replaced before the consumer took it was never
+    presented, so its dirty rows are carried into every frame published
+    until the consumer is seen taking one.
+*/
+void publish_frame(struct triple_buffer *buffer, const uint64_t *rows, uint32_t dirty){
+    struct frame *frame = &buffer->frames[buffer->back];
+
+    buffer->carry |= dirty;
+    memcpy(frame->rows, rows, sizeof(frame->rows));
+    frame->dirty = buffer->carry;
+
+    unsigned int previous = atomic_exchange_explicit(&buffer->shared, buffer->back | FRAME_FRESH,
+            memory_order_acq_rel);
+    if(!(previous & FRAME_FRESH)){
+        /* The consumer took the previous frame, only this one can be missing now */
+        buffer->carry = dirty;
+    }
+    buffer->back = previous & FRAME_INDEX;
+}
+
+/* Returns the most recent frame, or NULL if nothing was published since the last call */
+const struct frame *take_frame(struct triple_buffer *buffer){
+    if(!(atomic_load_explicit(&buffer->shared, memory_order_relaxed) & FRAME_FRESH)){
+        return NULL;
+    }
+    unsigned int previous = atomic_exchange_explicit(&buffer->shared, buffer->front,
+            memory_order_acq_rel);
+    buffer->front = previous & FRAME_INDEX;
+    return &buffer->frames[buffer->front];
+}
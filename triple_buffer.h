@@ -0,0 +1,35 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cpu.h"
+
+/* A completed frame, dirty has a bit set for every row that may differ from the last frame taken */
+struct frame{
+    uint64_t rows[DISPLAY_HEIGTH];
+    uint32_t dirty;
+};
+
+/*
+    Hands frames from the emulation thread to the render thread without
+    locks. The producer owns one slot, the consumer owns another and the
+    third is exchanged atomically between them, so neither side ever waits
+    for the other. Exactly one thread may publish and one thread may take.
+*/
+struct triple_buffer{
+    struct frame frames[3];
+    /* Index of the shared slot, with FRAME_FRESH set until it is taken */
+    atomic_uint shared;
+    /* Only touched by the producer */
+    unsigned int back;
+    uint32_t carry;
+    /* Only touched by the consumer */
+    unsigned int front;
+};
+
+void init_triple_buffer(struct triple_buffer *);
+void publish_frame(struct triple_buffer *, const uint64_t *, uint32_t);
+const struct frame *take_frame(struct triple_buffer *);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "batch.h"
+#include "vec_env.h"
+#include "libchip8.h"
+
+/*
+    N copies of one ROM stepped together on the batch engine. Stepping only
+    touches memory allocated up front, and the observations are the one
+    copy made out of the lanes.
+*/
+struct chip8_vec_env{
+    struct chip8_batch *batch;
+    /* The state every environment starts from */
+    struct chip8 *initial;
+    unsigned int seed;
+    /* Reset count per environment, so each episode gets new random numbers */
+    unsigned int *episodes;
+    struct chip8_reward *rewards;
+    size_t reward_count;
+    /* Reward bytes as of the end of the previous step, [reward_count][stride] */
+    unsigned char *reward_bytes;
+    struct chip8_vec_env_buffers buffers;
+};
+
+/* Packs the framebuffer of one environment into the observation buffer */
+static void write_observation(struct chip8_vec_env *env, size_t l){
+    const struct chip8_batch *b = env->batch;
+    uint64_t *observation = env->buffers.observations + l * DISPLAY_HEIGTH;
+
+    for(int r = 0; r < DISPLAY_HEIGTH; r++){
+        observation[r] = b->display_memory[r * b->stride + l];
+    }
+}
+
+CHIP8_API struct chip8_vec_env *new_chip8_vec_env(const unsigned char *rom, size_t rom_size, size_t envs,
+        unsigned int seed, const struct chip8_reward *rewards, size_t reward_count,
+        const struct chip8_vec_env_buffers *buffers){
+    struct chip8_vec_env *env = calloc(1, sizeof(struct chip8_vec_env));
+    if(env == NULL){
+        perror("Environment allocation failed");
+        return NULL;
+    }
+    env->initial = new_chip8();
+    if(env->initial == NULL){
+        perror("Environment allocation failed");
+        free_chip8_vec_env(env);
+        return NULL;
+    }
+    env->initial->fusion_enabled = 0;
+    if(load_rom_buffer(env->initial, rom, rom_size) < 0){
+        perror("ROM too large to fit into memory");
+        free_chip8_vec_env(env);
+        return NULL;
+    }
+    env->batch = new_chip8_batch(envs, env->initial);
+    env->episodes = calloc(envs, sizeof(unsigned int));
+    /* One spare entry so that no rewards is not mistaken for a failed allocation */
+    env->rewards = malloc((reward_count + 1) * sizeof(struct chip8_reward));
+    if(env->batch == NULL || env->episodes == NULL || env->rewards == NULL){
+        free_chip8_vec_env(env);
+        return NULL;
+    }
+    env->reward_bytes = malloc((reward_count + 1) * env->batch->stride);
+    if(env->reward_bytes == NULL){
+        free_chip8_vec_env(env);
+        return NULL;
+    }
+    if(reward_count != 0){
+        memcpy(env->rewards, rewards, reward_count * sizeof(struct chip8_reward));
+    }
+    env->reward_count = reward_count;
+    env->seed = seed;
+    if(buffers != NULL){
+        env->buffers = *buffers;
+    }
+    chip8_vec_env_reset(env, NULL);
+    return env;
+}
+
+CHIP8_API void free_chip8_vec_env(struct chip8_vec_env *env){
+    if(env->batch != NULL){
+        free_chip8_batch(env->batch);
+    }
+    if(env->initial != NULL){
+        free_chip8(env->initial);
+    }
+    free(env->episodes);
+    free(env->rewards);
+    free(env->reward_bytes);
+    free(env);
+}
+
+/*
+    Puts the environments whose mask byte is set, or all of them if mask is
+    NULL, back in the initial state, and writes their first observation
+*/
+CHIP8_API void chip8_vec_env_reset(struct chip8_vec_env *env, const unsigned char *mask){
+    struct chip8_batch *b = env->batch;
+
+    for(size_t l = 0; l < b->lanes; l++){
+        if(mask != NULL && !mask[l]){
+            continue;
+        }
+        batch_set_lane(b, l, env->initial);
+        b->rng_state[l] = rng_state_for_seed(env->seed + l + b->lanes * env->episodes[l]++);
+        for(size_t i = 0; i < env->reward_count; i++){
+            env->reward_bytes[i * b->stride + l] = b->memory[(env->rewards[i].address & 0xfff) * b->stride + l];
+        }
+        if(env->buffers.observations != NULL){
+            write_observation(env, l);
+        }
+        if(env->buffers.rewards != NULL){
+            env->buffers.rewards[l] = 0;
+        }
+        if(env->buffers.dones != NULL){
+            env->buffers.dones[l] = 0;
+        }
+    }
+}
+
+/*
+    Holds down the keys in actions[i] (one bit per key) in environment i for
+    the given number of frames, then writes observations, rewards and dones.
+    As in the emulator, a key is pressed once when it goes down: an action
+    kept over several frames or steps answers one Fx0A, not every one.
+*/
+CHIP8_API void chip8_vec_env_step(struct chip8_vec_env *env, const uint16_t *actions, int frames){
+    struct chip8_batch *b = env->batch;
+    size_t n = b->stride;
+    size_t lanes = b->lanes;
+
+    for(int key = 0; key < 16; key++){
+        unsigned char *keys = b->keys + key * n;
+        for(size_t l = 0; l < lanes; l++){
+            keys[l] = (actions[l] >> key) & 1;
+        }
+    }
+    for(int frame = 0; frame < frames; frame++){
+        batch_run_frame(b);
+    }
+
+    if(env->buffers.rewards != NULL){
+        float *rewards = env->buffers.rewards;
+        memset(rewards, 0, lanes * sizeof(float));
+        for(size_t i = 0; i < env->reward_count; i++){
+            const unsigned char *now = b->memory + (env->rewards[i].address & 0xfff) * n;
+            unsigned char *before = env->reward_bytes + i * n;
+            float scale = env->rewards[i].scale;
+            for(size_t l = 0; l < lanes; l++){
+                rewards[l] += scale * (now[l] - before[l]);
+                before[l] = now[l];
+            }
+        }
+    }
+    if(env->buffers.dones != NULL){
+        for(size_t l = 0; l < lanes; l++){
+            env->buffers.dones[l] = b->status[l] == LANE_FAULTED;
+        }
+    }
+    if(env->buffers.observations != NULL){
+        /* Row major in the lanes, transposed into one block per environment */
+        for(int r = 0; r < DISPLAY_HEIGTH; r++){
+            const uint64_t *row = b->display_memory + r * n;
+            uint64_t *observation = env->buffers.observations + r;
+            for(size_t l = 0; l < lanes; l++){
+                observation[l * DISPLAY_HEIGTH] = row[l];
+            }
+        }
+    }
+}
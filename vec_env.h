@@ -0,0 +1,43 @@
+#ifndef VEC_ENV_H
+#define VEC_ENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct chip8_vec_env;
+
+/* Reward term: scale times how much the byte at address grew during a step */
+struct chip8_reward{
+    unsigned short address;
+    float scale;
+};
+
+/*
+    Caller owned buffers the environments write into, typically shared
+    memory read by the trainer. Any of them may be NULL.
+    observations: envs * DISPLAY_HEIGTH rows, environment i at i * DISPLAY_HEIGTH,
+                  in the display_memory layout (bit 63 is the leftmost pixel)
+    rewards: envs floats
+    dones: envs bytes, set once an environment faulted and needs a reset
+*/
+struct chip8_vec_env_buffers{
+    uint64_t *observations;
+    float *rewards;
+    unsigned char *dones;
+};
+
+struct chip8_vec_env *new_chip8_vec_env(const unsigned char *, size_t, size_t, unsigned int,
+        const struct chip8_reward *, size_t, const struct chip8_vec_env_buffers *);
+void free_chip8_vec_env(struct chip8_vec_env *);
+void chip8_vec_env_reset(struct chip8_vec_env *, const unsigned char *);
+void chip8_vec_env_step(struct chip8_vec_env *, const uint16_t *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif